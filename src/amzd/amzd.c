@@ -0,0 +1,626 @@
+/*
+ * amzd: long-lived daemon decrypting and parsing AMZ files over a unix socket.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib/gstdio.h>
+#include <libxml/parser.h>
+
+#include "libamz.h"
+
+/*
+ * Wire protocol.
+ *
+ * A client sends any number of requests on one connection, each answered
+ * in order.  Every frame, in either direction, is a one byte opcode or
+ * status followed by a 32-bit big-endian payload length and the payload.
+ *
+ *   request opcodes:
+ *     'd'  payload is a path; reply is the decrypted XSPF document.
+ *     'D'  payload is the contents of an .amz file; reply as for 'd'.
+ *     'l'  payload is a path; reply is the parsed track list.
+ *     'L'  payload is the contents of an .amz file; reply as for 'l'.
+ *
+ * A track list is a 32-bit big-endian entry count followed by, for each
+ * entry, the NUL-terminated strings location, title, creator, album,
+ * tracknum, duration and trackType.
+ *
+ * Replies other than AMZD_STATUS_OK carry a human-readable message.  A
+ * request over the size limit is answered with AMZD_STATUS_TOO_LARGE and
+ * the connection is closed, since its payload is never read.
+ */
+#define AMZD_OP_DECRYPT_PATH	'd'
+#define AMZD_OP_DECRYPT_BLOB	'D'
+#define AMZD_OP_PARSE_PATH	'l'
+#define AMZD_OP_PARSE_BLOB	'L'
+
+#define AMZD_STATUS_OK		0
+#define AMZD_STATUS_ERROR	1
+#define AMZD_STATUS_TOO_LARGE	2
+#define AMZD_STATUS_BAD_REQUEST	3
+
+#define AMZD_HEADER_LEN		5
+#define AMZD_IO_TIMEOUT		30
+
+/*
+ * A client is owned by the main loop while a frame is read or a reply is
+ * written, and by a worker while its request is served; it is never in
+ * both places at once.
+ */
+typedef struct {
+	gint fd;
+	GIOChannel *channel;
+	guint watch;
+	guint timeout;
+
+	guchar header[AMZD_HEADER_LEN];
+	guint32 len;
+	gchar *payload;
+	gsize got;
+
+	GString *reply;
+	gsize sent;
+	bool closing;
+} AMZDClient;
+
+static gchar *socket_path = NULL;
+static gint max_threads = 8;
+static gint max_request = 1024 * 1024;
+
+static GThreadPool *pool;
+static gchar socket_path_buf[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+static GOptionEntry options[] = {
+	{ "socket", 's', 0, G_OPTION_ARG_FILENAME, &socket_path, "Listen on PATH", "PATH" },
+	{ "threads", 'j', 0, G_OPTION_ARG_INT, &max_threads, "Serve at most N requests at once", "N" },
+	{ "max-request", 'm', 0, G_OPTION_ARG_INT, &max_request, "Refuse requests or files larger than BYTES", "BYTES" },
+	{ NULL }
+};
+
+static void
+amzd_reply(AMZDClient *client, guchar status, gconstpointer data, gsize len)
+{
+	guint32 belen = GUINT32_TO_BE((guint32) len);
+
+	if (client->reply == NULL)
+		client->reply = g_string_sized_new(AMZD_HEADER_LEN + len);
+
+	g_string_append_c(client->reply, status);
+	g_string_append_len(client->reply, (gchar *) &belen, sizeof belen);
+	g_string_append_len(client->reply, data, len);
+}
+
+static void
+amzd_reply_error(AMZDClient *client, guchar status, const gchar *message)
+{
+	amzd_reply(client, status, message, strlen(message));
+}
+
+static void
+amzd_append_string(GString *out, const gchar *str)
+{
+	g_string_append(out, str != NULL ? str : "");
+	g_string_append_c(out, '\0');
+}
+
+static void
+amzd_append_entries(GString *out, GList *list)
+{
+	GList *node;
+	guint32 count = GUINT32_TO_BE(g_list_length(list));
+	gchar number[32];
+
+	g_string_append_len(out, (gchar *) &count, sizeof count);
+
+	for (node = list; node != NULL; node = node->next)
+	{
+		AMZPlaylistEntry *entry = node->data;
+
+		amzd_append_string(out, entry->location);
+		amzd_append_string(out, entry->title);
+		amzd_append_string(out, entry->creator);
+		amzd_append_string(out, entry->album);
+
+		g_snprintf(number, sizeof number, "%d", entry->tracknum);
+		amzd_append_string(out, number);
+		g_snprintf(number, sizeof number, "%" G_GINT64_FORMAT, entry->duration);
+		amzd_append_string(out, number);
+
+		amzd_append_string(out, entry->meta ? g_hash_table_lookup(entry->meta, "http://www.amazon.com/dmusic/trackType") : "mp3");
+	}
+}
+
+/*
+ * Reads a path request into memory, enforcing the same size limit as for
+ * inline blobs.
+ */
+static bool
+amzd_load_path(AMZDClient *client, const gchar *path, gchar **data, gsize *len)
+{
+	struct stat st;
+	GError *error = NULL;
+
+	if (g_stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+	{
+		amzd_reply_error(client, AMZD_STATUS_ERROR, "cannot open file");
+		return false;
+	}
+
+	if (st.st_size > max_request)
+	{
+		amzd_reply_error(client, AMZD_STATUS_TOO_LARGE, "file too large");
+		return false;
+	}
+
+	if (!g_file_get_contents(path, data, len, &error))
+	{
+		amzd_reply_error(client, AMZD_STATUS_ERROR, error->message);
+		g_error_free(error);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Serves the request read into client, leaving the reply in client->reply.
+ */
+static void
+amzd_handle_request(AMZDClient *client)
+{
+	gchar *amzdata = NULL;
+	gsize amzlen;
+	guchar *xspf = NULL;
+	gsize xspflen;
+
+	switch (client->header[0])
+	{
+	case AMZD_OP_DECRYPT_PATH:
+	case AMZD_OP_PARSE_PATH:
+		if (!amzd_load_path(client, client->payload, &amzdata, &amzlen))
+			goto out;
+		break;
+	case AMZD_OP_DECRYPT_BLOB:
+	case AMZD_OP_PARSE_BLOB:
+		amzdata = client->payload;
+		amzlen = client->len;
+		client->payload = NULL;
+		break;
+	default:
+		amzd_reply_error(client, AMZD_STATUS_BAD_REQUEST, "unknown opcode");
+		goto out;
+	}
+
+	if (!amzfile_decrypt_blob(amzdata, amzlen, &xspf, &xspflen))
+	{
+		amzd_reply_error(client, AMZD_STATUS_ERROR, "unable to decrypt amz data");
+		goto out;
+	}
+
+	if (client->header[0] == AMZD_OP_DECRYPT_PATH || client->header[0] == AMZD_OP_DECRYPT_BLOB)
+		amzd_reply(client, AMZD_STATUS_OK, xspf, xspflen);
+	else
+	{
+		GList *list;
+		GString *out;
+
+		/* a playlist without tracks is answered with a count of zero. */
+		if (!amzplaylist_parse_filtered(xspf, NULL, &list))
+		{
+			amzd_reply_error(client, AMZD_STATUS_ERROR, "failed to parse embedded xspf document");
+			if (list != NULL)
+				amzplaylist_free(list);
+			goto out;
+		}
+
+		out = g_string_new(NULL);
+		amzd_append_entries(out, list);
+		amzd_reply(client, AMZD_STATUS_OK, out->str, out->len);
+
+		g_string_free(out, TRUE);
+		if (list != NULL)
+			amzplaylist_free(list);
+	}
+
+out:
+	g_free(xspf);
+	g_free(amzdata);
+}
+
+static void
+amzd_client_stop_timer(AMZDClient *client)
+{
+	if (client->timeout != 0)
+		g_source_remove(client->timeout);
+
+	client->timeout = 0;
+}
+
+static void
+amzd_client_free(AMZDClient *client)
+{
+	if (client->watch != 0)
+		g_source_remove(client->watch);
+	amzd_client_stop_timer(client);
+
+	if (client->reply != NULL)
+		g_string_free(client->reply, TRUE);
+	g_free(client->payload);
+
+	g_io_channel_unref(client->channel);
+	close(client->fd);
+	g_slice_free(AMZDClient, client);
+}
+
+static gboolean
+amzd_client_timeout(gpointer userdata)
+{
+	AMZDClient *client = userdata;
+
+	client->timeout = 0;
+	amzd_client_free(client);
+
+	return FALSE;
+}
+
+/*
+ * Every frame, read or written, must be through within AMZD_IO_TIMEOUT
+ * of starting; connections idle between requests are left alone.
+ */
+static void
+amzd_client_start_timer(AMZDClient *client)
+{
+	if (client->timeout != 0)
+		g_source_remove(client->timeout);
+
+	client->timeout = g_timeout_add(AMZD_IO_TIMEOUT * 1000, amzd_client_timeout, client);
+}
+
+static gboolean amzd_client_readable(GIOChannel *channel, GIOCondition cond, gpointer userdata);
+
+static void
+amzd_client_arm(AMZDClient *client, GIOCondition cond, GIOFunc func)
+{
+	client->watch = g_io_add_watch(client->channel, cond | G_IO_HUP | G_IO_ERR, func, client);
+}
+
+static gboolean
+amzd_client_writable(GIOChannel *channel, GIOCondition cond, gpointer userdata)
+{
+	AMZDClient *client = userdata;
+	gssize r;
+
+	while (client->sent < client->reply->len)
+	{
+		r = write(client->fd, client->reply->str + client->sent, client->reply->len - client->sent);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return TRUE;
+		if (r <= 0)
+		{
+			client->watch = 0;
+			amzd_client_free(client);
+			return FALSE;
+		}
+
+		client->sent += r;
+	}
+
+	client->watch = 0;
+
+	if (client->closing)
+	{
+		amzd_client_free(client);
+		return FALSE;
+	}
+
+	amzd_client_stop_timer(client);
+	g_string_free(client->reply, TRUE);
+	client->reply = NULL;
+	client->got = 0;
+
+	amzd_client_arm(client, G_IO_IN, amzd_client_readable);
+
+	return FALSE;
+}
+
+static gboolean
+amzd_client_send(gpointer userdata)
+{
+	AMZDClient *client = userdata;
+
+	client->sent = 0;
+	amzd_client_start_timer(client);
+	amzd_client_arm(client, G_IO_OUT, amzd_client_writable);
+
+	return FALSE;
+}
+
+/*
+ * Frames are read by the main loop without blocking, and only a complete
+ * request is handed to a worker, so slow or idle clients never tie up a
+ * thread.  Reading stops at the end of each frame until it is answered.
+ */
+static gboolean
+amzd_client_readable(GIOChannel *channel, GIOCondition cond, gpointer userdata)
+{
+	AMZDClient *client = userdata;
+	gchar *buf;
+	gsize want;
+	gssize r;
+
+	for (;;)
+	{
+		if (client->got < AMZD_HEADER_LEN)
+		{
+			buf = (gchar *) client->header + client->got;
+			want = AMZD_HEADER_LEN - client->got;
+		}
+		else if (client->got - AMZD_HEADER_LEN < client->len)
+		{
+			buf = client->payload + (client->got - AMZD_HEADER_LEN);
+			want = client->len - (client->got - AMZD_HEADER_LEN);
+		}
+		else
+			break;
+
+		r = read(client->fd, buf, want);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return TRUE;
+		if (r <= 0)
+		{
+			client->watch = 0;
+			amzd_client_free(client);
+			return FALSE;
+		}
+
+		if (client->got == 0)
+			amzd_client_start_timer(client);
+		client->got += r;
+
+		if (client->got != AMZD_HEADER_LEN)
+			continue;
+
+		memcpy(&client->len, client->header + 1, sizeof client->len);
+		client->len = GUINT32_FROM_BE(client->len);
+
+		if (client->len > (guint32) max_request)
+		{
+			client->watch = 0;
+			client->closing = true;
+			amzd_reply_error(client, AMZD_STATUS_TOO_LARGE, "request too large");
+			amzd_client_send(client);
+			return FALSE;
+		}
+
+		client->payload = g_malloc(client->len + 1);
+	}
+
+	client->payload[client->len] = '\0';
+	client->watch = 0;
+	amzd_client_stop_timer(client);
+
+	g_thread_pool_push(pool, client, NULL);
+
+	return FALSE;
+}
+
+static void
+amzd_worker(gpointer data, gpointer userdata)
+{
+	AMZDClient *client = data;
+
+	amzd_handle_request(client);
+
+	g_free(client->payload);
+	client->payload = NULL;
+
+	g_idle_add(amzd_client_send, client);
+}
+
+static gboolean
+amzd_accept(GIOChannel *channel, GIOCondition cond, gpointer userdata)
+{
+	AMZDClient *client;
+	gint fd;
+
+	fd = accept(g_io_channel_unix_get_fd(channel), NULL, NULL);
+	if (fd < 0)
+		return TRUE;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	client = g_slice_new0(AMZDClient);
+	client->fd = fd;
+	client->channel = g_io_channel_unix_new(fd);
+
+	amzd_client_arm(client, G_IO_IN, amzd_client_readable);
+
+	return TRUE;
+}
+
+/*
+ * Clears the way for bind().  Only a socket nobody is listening on, left
+ * behind by a daemon that did not exit cleanly, is removed; anything else
+ * at path means the path is wrong or another daemon is using it.
+ */
+static bool
+amzd_remove_stale(const gchar *path, const struct sockaddr_un *sun)
+{
+	struct stat st;
+	gint fd;
+	bool stale;
+
+	if (g_lstat(path, &st) < 0)
+	{
+		if (errno == ENOENT)
+			return true;
+
+		fprintf(stderr, "amzd: cannot use %s: %s\n", path, g_strerror(errno));
+		return false;
+	}
+
+	if (!S_ISSOCK(st.st_mode))
+	{
+		fprintf(stderr, "amzd: %s exists and is not a socket\n", path);
+		return false;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		perror("amzd: socket");
+		return false;
+	}
+
+	stale = connect(fd, (const struct sockaddr *) sun, sizeof *sun) < 0 && errno == ECONNREFUSED;
+	close(fd);
+
+	if (!stale)
+	{
+		fprintf(stderr, "amzd: %s is in use by another daemon\n", path);
+		return false;
+	}
+
+	if (unlink(path) < 0 && errno != ENOENT)
+	{
+		fprintf(stderr, "amzd: cannot remove %s: %s\n", path, g_strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static gint
+amzd_listen(const gchar *path)
+{
+	struct sockaddr_un sun;
+	gint fd;
+
+	if (strlen(path) >= sizeof sun.sun_path)
+	{
+		fprintf(stderr, "amzd: socket path too long: %s\n", path);
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	g_strlcpy(sun.sun_path, path, sizeof sun.sun_path);
+
+	if (!amzd_remove_stale(path, &sun))
+		return -1;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		perror("amzd: socket");
+		return -1;
+	}
+
+	umask(077);
+
+	if (bind(fd, (struct sockaddr *) &sun, sizeof sun) < 0 || listen(fd, SOMAXCONN) < 0)
+	{
+		fprintf(stderr, "amzd: cannot listen on %s: %s\n", path, g_strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+amzd_shutdown(gint sig)
+{
+	unlink(socket_path_buf);
+	_exit(EXIT_SUCCESS);
+}
+
+int
+main(gint argc, gchar *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	GMainLoop *loop;
+	GIOChannel *listener;
+	gint fd;
+
+	context = g_option_context_new("- serve AMZ decryption and parsing over a unix socket");
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		fprintf(stderr, "%s: %s\n", argv[0], error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(context);
+
+	if (socket_path == NULL)
+		socket_path = g_build_filename(g_get_tmp_dir(), "amzd.sock", NULL);
+
+	if (max_threads < 1 || max_request < 1)
+	{
+		fprintf(stderr, "%s: --threads and --max-request must be positive\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	/* pay for library initialisation once, rather than per request. */
+	gcry_check_version(NULL);
+	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+	xmlInitParser();
+
+	if ((fd = amzd_listen(socket_path)) < 0)
+		return EXIT_FAILURE;
+
+	g_strlcpy(socket_path_buf, socket_path, sizeof socket_path_buf);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, amzd_shutdown);
+	signal(SIGTERM, amzd_shutdown);
+
+	pool = g_thread_pool_new(amzd_worker, NULL, max_threads, FALSE, &error);
+	if (pool == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", argv[0], error->message);
+		return EXIT_FAILURE;
+	}
+
+	listener = g_io_channel_unix_new(fd);
+	g_io_add_watch(listener, G_IO_IN, amzd_accept, NULL);
+
+	loop = g_main_loop_new(NULL, FALSE);
+	g_main_loop_run(loop);
+
+	return EXIT_SUCCESS;
+}
@@ -20,22 +20,147 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+#include <glib/gstdio.h>
+
+#include "amzdownload.h"
+
+static gint failures = 0;
+
+static volatile sig_atomic_t stopping = 0;
+static gint stop_pipe[2] = { -1, -1 };
+static AMZPipeline *running = NULL;
+
+static gchar *watch_dir = NULL;
+static gchar *state_path = NULL;
+static FILE *state_file = NULL;
+static GHashTable *seen = NULL;
+
+/*
+ * Identifies a dropped file by name, size and mtime, so that a new download
+ * reusing an old name is not mistaken for one already processed.
+ */
+static gchar *
+file_key(const gchar *path)
+{
+	struct stat st;
+	gchar *base, *ret;
+
+	if (g_stat(path, &st) < 0)
+		return NULL;
 
-#include "libamz.h"
+	base = g_path_get_basename(path);
+	ret = g_strdup_printf("%s\t%" G_GINT64_FORMAT "\t%ld", base, (gint64) st.st_size, (long) st.st_mtime);
+	g_free(base);
+
+	return ret;
+}
 
 static void
-handle_progress(SoupMessage *msg, AMZDownloadContext *ctx)
+record_processed(const gchar *path)
+{
+	gchar *key;
+
+	if (state_file == NULL || (key = file_key(path)) == NULL)
+		return;
+
+	fprintf(state_file, "%s\n", key);
+	fflush(state_file);
+
+	g_free(key);
+}
+
+static void
+handle_progress(const AMZDownloadContext *ctx, gpointer userdata)
 {
 	g_print("Got %d bytes of %d bytes, %.2f percent complete.\r",
 		ctx->bytes, ctx->length, ctx->progress);
 }
 
+static void
+handle_result(const AMZPipelineResult *result, gpointer userdata)
+{
+	bool broken = result->url == NULL && !result->success;
+
+	/* interrupted files are left for the next run to pick up again. */
+	if (result->cancelled)
+		return;
+
+	if (broken)
+	{
+		fprintf(stderr, "failed to parse xspf file embedded in %s\n", result->file);
+		failures++;
+	}
+	else if (result->url != NULL && result->success)
+		g_print("\nDownloaded %s.\n", result->path);
+	else if (result->url != NULL)
+	{
+		g_print("\nFailed to download %s.\n", result->path != NULL ? result->path : result->url);
+		failures++;
+	}
+
+	if (!result->file_done)
+		return;
+
+	/* the summary is left out while stopping, but finished files are still recorded. */
+	if (!stopping && !broken)
+	{
+		if (result->file_tracks == 0)
+			g_print("No tracks to download in %s.\n", result->file);
+		else if (result->file_failures == 0)
+			g_print("\nAll tracks have been downloaded for %s.\n", result->file);
+		else
+			g_print("\n%u track%s of %s could not be downloaded.\n", result->file_failures,
+				result->file_failures != 1 ? "s" : "", result->file);
+	}
+
+	/*
+	 * failed tracks are retried after a restart; broken files are not.
+	 * Tracks cut short by a signal count as failures here.
+	 */
+	if (result->file_failures == 0 || broken)
+		record_processed(result->file);
+}
+
+static bool
+same_string(const gchar *a, const gchar *b)
+{
+	return a == b || (a != NULL && b != NULL && !strcmp(a, b));
+}
+
 gchar *
-build_download_path(AMZPlaylistEntry *entry)
+build_download_path(AMZPlaylistEntry *entry, gpointer userdata)
 {
+	static gchar *last_album = NULL, *last_creator = NULL;
 	gchar *ret, *dir, *filename, *extension;
 
+	/* tracks arrive in playlist order, so this marks the start of each album. */
+	if (!same_string(entry->album, last_album) || !same_string(entry->creator, last_creator))
+	{
+		g_print("Downloading album %s by %s.\n", entry->album, entry->creator);
+
+		g_free(last_album);
+		g_free(last_creator);
+		last_album = g_strdup(entry->album);
+		last_creator = g_strdup(entry->creator);
+	}
+
 	extension = entry->meta ? g_hash_table_lookup(entry->meta, "http://www.amazon.com/dmusic/trackType") : "mp3";
 	filename = g_strdup_printf("%02d - %s.%s", entry->tracknum, entry->title, extension);
 	dir = g_build_filename(g_get_home_dir(), "Music", entry->creator, entry->album, NULL);
@@ -43,71 +168,351 @@ build_download_path(AMZPlaylistEntry *entry)
 
 	g_mkdir_with_parents(dir, 0755);
 
+	g_print("Queueing %s as %s.\n", entry->title, ret);
+
+	g_free(filename);
 	g_free(dir);
 
 	return ret;
 }
 
-void
-handle_amz_file(SoupSession *session, const gchar *file)
+static gpointer
+print_stats(gpointer userdata)
+{
+	AMZPipeline *pipeline = userdata;
+	AMZPipelineStageStats stats[8];
+	guint i, n;
+
+	while (!amzpipeline_is_finished(pipeline))
+	{
+		g_usleep(G_USEC_PER_SEC);
+
+		n = amzpipeline_get_stats(pipeline, stats, G_N_ELEMENTS(stats));
+		for (i = 0; i < n; i++)
+			fprintf(stderr, "%s %u/%u busy %u done %" G_GUINT64_FORMAT "%s", stats[i].name,
+				stats[i].depth, stats[i].capacity, stats[i].busy, stats[i].processed,
+				i + 1 < n ? " | " : "\n");
+	}
+
+	return NULL;
+}
+
+/*
+ * Only async-signal-safe work happens here: the pipeline stops on its own
+ * threads, and the watch loop wakes up through the pipe.  A second signal
+ * gets the default action.
+ */
+static void
+handle_signal(gint signum)
+{
+	gint saved = errno;
+
+	stopping = 1;
+
+	if (running != NULL)
+		amzpipeline_cancel(running);
+
+	if (stop_pipe[1] >= 0)
+		(void) write(stop_pipe[1], "", 1);
+
+	errno = saved;
+}
+
+static bool
+install_signals(void)
+{
+	struct sigaction sa;
+
+	if (pipe(stop_pipe) < 0)
+		return false;
+
+	fcntl(stop_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(stop_pipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(stop_pipe[1], F_SETFL, O_NONBLOCK);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = handle_signal;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+
+	return sigaction(SIGINT, &sa, NULL) == 0 && sigaction(SIGTERM, &sa, NULL) == 0;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static bool
+load_state(const gchar *path)
 {
-	GList *list, *node;
-	guchar *data;
-	gsize len;
+	gchar *data, **lines;
+	GError *error = NULL;
+	guint i;
 
-	g_return_if_fail(file != NULL);
+	seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
-	amzfile_decrypt_file(file, &data, &len);
-	list = amzplaylist_parse(data);
-	if (list == NULL)
+	if (g_file_get_contents(path, &data, NULL, &error))
 	{
-		fprintf(stderr, "failed to parse xspf file embedded in %s\n", file);
-		exit(EXIT_FAILURE);
+		lines = g_strsplit(data, "\n", -1);
+		for (i = 0; lines[i] != NULL; i++)
+		{
+			if (*lines[i] != '\0')
+				g_hash_table_insert(seen, g_strdup(lines[i]), GINT_TO_POINTER(1));
+		}
+
+		g_strfreev(lines);
+		g_free(data);
 	}
+	else
+		g_error_free(error);
 
+	if ((state_file = g_fopen(path, "a")) == NULL)
 	{
-		AMZPlaylistEntry *entry = list->data;
+		fprintf(stderr, "cannot open %s: %s\n", path, g_strerror(errno));
+		return false;
+	}
 
-		g_print("Downloading album %s by %s.\n", entry->album, entry->creator);
+	return true;
+}
+
+static void
+queue_watched(AMZPipeline *pipeline, const gchar *dir, const gchar *name)
+{
+	gchar *path, *key;
+	gsize len = strlen(name);
+
+	if (len < 4 || g_ascii_strcasecmp(name + len - 4, ".amz"))
+		return;
+
+	path = g_build_filename(dir, name, NULL);
+
+	if ((key = file_key(path)) != NULL && g_hash_table_lookup(seen, key) == NULL)
+	{
+		g_hash_table_insert(seen, key, GINT_TO_POINTER(1));
+		key = NULL;
+
+		g_print("Picked up %s.\n", path);
+		amzpipeline_push_file(pipeline, path);
 	}
 
-	for (node = list; node != NULL; node = node->next)
+	g_free(key);
+	g_free(path);
+}
+
+static void
+scan_directory(AMZPipeline *pipeline, const gchar *dir)
+{
+	GDir *d;
+	const gchar *name;
+
+	if ((d = g_dir_open(dir, 0, NULL)) == NULL)
+		return;
+
+	while ((name = g_dir_read_name(d)) != NULL)
+		queue_watched(pipeline, dir, name);
+
+	g_dir_close(d);
+}
+
+/*
+ * Feeds .amz files into the pipeline as soon as they are complete: when
+ * the browser closes them after writing, or renames them into place.
+ * Files present before the watch started are picked up once as well.
+ * Returns once SIGINT or SIGTERM arrives.
+ */
+static bool
+watch_directory(AMZPipeline *pipeline, const gchar *dir)
+{
+	gchar buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pollfd fds[2];
+	gchar *p;
+	gssize len;
+	gint fd;
+
+	if ((fd = inotify_init()) < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
 	{
-		gchar *path;
-		AMZPlaylistEntry *entry = node->data;
+		fprintf(stderr, "cannot watch %s: %s\n", dir, g_strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	scan_directory(pipeline, dir);
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = stop_pipe[0];
+	fds[1].events = POLLIN;
+
+	while (!stopping)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents != 0)
+		{
+			close(fd);
+			return true;
+		}
+
+		if (fds[0].revents == 0)
+			continue;
+
+		len = read(fd, buf, sizeof buf);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
 
-		path = build_download_path(entry);
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event *) p;
 
-		g_print("\nDownloading %s as %s.\n", entry->title, path);
-		amzdownload_session_download_url(session, entry->location, path, handle_progress);
+			if (ev->mask & IN_Q_OVERFLOW)
+				scan_directory(pipeline, dir);
+			else if (ev->len > 0 && !(ev->mask & IN_ISDIR))
+				queue_watched(pipeline, dir, ev->name);
+		}
 	}
 
-	g_print("\nAll tracks have been downloaded for this album.\n");
+	close(fd);
+	if (stopping)
+		return true;
+
+	fprintf(stderr, "stopped watching %s: %s\n", dir, g_strerror(errno));
+
+	return false;
 }
+#endif
+
+static gboolean hedge = FALSE;
+static gdouble hedge_ratio = 0;
+static gboolean tag = FALSE;
+static gboolean show_stats = FALSE;
+static gint jobs = 0;
+static gint depth = 16;
+static gchar *transport = NULL;
+static gchar *filter_expr = NULL;
+
+static GOptionEntry options[] = {
+	{ "hedge", 'H', 0, G_OPTION_ARG_NONE, &hedge, "Send a duplicate request for stalled transfers", NULL },
+	{ "hedge-ratio", 0, 0, G_OPTION_ARG_DOUBLE, &hedge_ratio, "Cap duplicate requests to this fraction of all transfers (at most 0.5)", "RATIO" },
+	{ "tag", 'T', 0, G_OPTION_ARG_NONE, &tag, "Tag files with the playlist metadata while downloading", NULL },
+	{ "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "Download up to N tracks at once", "N" },
+	{ "queue-depth", 'q', 0, G_OPTION_ARG_INT, &depth, "Hold at most N items between pipeline stages", "N" },
+	{ "stats", 's', 0, G_OPTION_ARG_NONE, &show_stats, "Print pipeline stage occupancy every second", NULL },
+	{ "watch", 'w', 0, G_OPTION_ARG_FILENAME, &watch_dir, "Download .amz files as they appear in DIR", "DIR" },
+	{ "state", 0, 0, G_OPTION_ARG_FILENAME, &state_path, "Record processed files in FILE (default DIR/.amzdl-processed)", "FILE" },
+	{ "filter", 'f', 0, G_OPTION_ARG_STRING, &filter_expr, "Only download tracks matching EXPR, e.g. 'disc=2 type=flac'", "EXPR" },
+	{ "transport", 't', 0, G_OPTION_ARG_STRING, &transport, "HTTP transport to use (soup, curl)", "NAME" },
+	{ NULL }
+};
 
 int
-main(gint argc, const gchar *argv[])
+main(gint argc, gchar *argv[])
 {
-	GMainLoop *loop;
-	SoupSession *session;
+	GOptionContext *context;
+	GError *error = NULL;
+	AMZDownloadSession *session;
+	AMZPipeline *pipeline;
+	AMZPlaylistFilter *filter = NULL;
+	GThread *stats = NULL;
 	gint i;
 
-	g_type_init();
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	context = g_option_context_new("file.amz...");
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		fprintf(stderr, "%s: %s\n", argv[0], error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(context);
+
+	if (argc < 2 && watch_dir == NULL)
+	{
+		fprintf(stderr, "usage: %s [--hedge] [--tag] [--jobs N] [--filter EXPR] [--transport NAME] [--watch DIR] file.amz\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (filter_expr != NULL && (filter = amzplaylist_filter_new(filter_expr, &error)) == NULL)
+	{
+		fprintf(stderr, "%s: bad filter: %s\n", argv[0], error->message);
+		return EXIT_FAILURE;
+	}
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if (watch_dir != NULL)
+	{
+		if (state_path == NULL)
+			state_path = g_build_filename(watch_dir, ".amzdl-processed", NULL);
 
-	session = amzdownload_session_new();
-	loop = g_main_loop_new(NULL, TRUE);
+		if (!load_state(state_path))
+			return EXIT_FAILURE;
+	}
+#else
+	if (watch_dir != NULL)
+	{
+		fprintf(stderr, "%s: --watch is not supported on this platform\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+#endif
 
-	if (argc < 2)
+	session = amzdownload_session_new_with_transport(transport);
+	if (session == NULL)
 	{
-		fprintf(stderr, "usage: %s file.amz\n", argv[0]);
+		fprintf(stderr, "%s: transport %s is not available\n", argv[0], transport);
 		return EXIT_FAILURE;
 	}
 
-	for (i = 1; i < argc; i++)
-		handle_amz_file(session, argv[i]);
+	amzdownload_session_set_hedging(session, hedge, hedge_ratio);
+	if (jobs > 0)
+		amzdownload_session_set_max_transfers(session, jobs);
+
+	pipeline = amzpipeline_new(session, MAX(depth, jobs), build_download_path, handle_result, NULL);
+	amzpipeline_set_tagging(pipeline, tag);
+	amzpipeline_set_filter(pipeline, filter);
+	amzpipeline_set_progress_func(pipeline, handle_progress);
+	if (!amzpipeline_start(pipeline))
+		return EXIT_FAILURE;
+
+	running = pipeline;
+	if (!install_signals())
+		fprintf(stderr, "%s: cannot install signal handlers: %s\n", argv[0], g_strerror(errno));
+
+	if (show_stats)
+		stats = g_thread_create(print_stats, pipeline, TRUE, NULL);
+
+	for (i = 1; i < argc && !stopping; i++)
+		amzpipeline_push_file(pipeline, argv[i]);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if (watch_dir != NULL && !watch_directory(pipeline, watch_dir))
+		failures++;
+#endif
+
+	amzpipeline_close(pipeline);
+	amzpipeline_join(pipeline);
+
+	if (stats != NULL)
+		g_thread_join(stats);
+
+	running = NULL;
+	amzpipeline_free(pipeline);
+	amzdownload_session_free(session);
+
+	if (stopping)
+	{
+		g_print("\nInterrupted; unfinished files will be downloaded again next time.\n");
+		failures++;
+	}
 
-	g_main_loop_unref(loop);
-	g_object_unref(session);
+	if (filter != NULL)
+		amzplaylist_filter_free(filter);
 
-	return EXIT_SUCCESS;
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
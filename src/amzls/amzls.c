@@ -24,24 +24,47 @@
 
 #include "libamz.h"
 
+static gchar *filter_expr = NULL;
+
+static GOptionEntry options[] = {
+	{ "filter", 'f', 0, G_OPTION_ARG_STRING, &filter_expr, "Only list tracks matching EXPR, e.g. 'disc=2 type=flac'", "EXPR" },
+	{ NULL }
+};
+
 int
-main(gint argc, const gchar *argv[])
+main(gint argc, gchar *argv[])
 {
+	GOptionContext *context;
+	GError *error = NULL;
+	AMZPlaylistFilter *filter = NULL;
 	GList *list, *node;
 	gint i = 1;
 
 	guchar *data;
 	gsize len, tracks;
 
-	if (!argv[1])
+	context = g_option_context_new("file.amz");
+	g_option_context_add_main_entries(context, options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		fprintf(stderr, "%s: %s\n", argv[0], error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(context);
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s [--filter EXPR] file.amz\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (filter_expr != NULL && (filter = amzplaylist_filter_new(filter_expr, &error)) == NULL)
 	{
-		fprintf(stderr, "usage: %s file.amz\n", argv[0]);
+		fprintf(stderr, "%s: bad filter: %s\n", argv[0], error->message);
 		return EXIT_FAILURE;
 	}
 
-	amzfile_decrypt_file(argv[1], &data, &len);
-	list = amzplaylist_parse(data);
-	if (list == NULL)
+	if (!amzfile_decrypt_file(argv[1], &data, &len) || !amzplaylist_parse_filtered(data, filter, &list))
 	{
 		fprintf(stderr, "failed to parse xspf file embedded in %s\n", argv[1]);
 		return EXIT_FAILURE;
@@ -62,7 +85,11 @@ main(gint argc, const gchar *argv[])
 		i++;
 	}
 
-	amzplaylist_free(list);
+	if (list != NULL)
+		amzplaylist_free(list);
+	if (filter != NULL)
+		amzplaylist_filter_free(filter);
+	g_free(data);
 
 	return EXIT_SUCCESS;
 }
@@ -22,25 +22,153 @@
 
 #include <stdio.h>
 #include <gtk/gtk.h>
-#include "libamz.h"
+#include "amzdownload.h"
 
-GtkWidget *window, *album, *song;
-GtkWidget *albumprogress, *songprogress;
+/*
+ * The download engine reports progress far more often than the screen can
+ * show it.  Callbacks only record the new state of a track and queue it as
+ * dirty; a tick running at roughly frame rate dispatches the engine's
+ * results and then pushes each dirty row to the model once.  gtk_main()
+ * already drives the network I/O, so the tick never runs the loop
+ * itself.  Only rows that changed are touched, and the tree view (fixed
+ * height mode) only renders rows that are visible, so the cost stays flat
+ * however many transfers are running.
+ */
+#define TICK_INTERVAL	33
+
+enum {
+	COL_TRACK,
+	COL_ALBUM,
+	COL_PROGRESS,
+	COL_STATUS,
+	N_COLUMNS
+};
+
+typedef enum {
+	TRACK_QUEUED,
+	TRACK_ACTIVE,
+	TRACK_DONE,
+	TRACK_FAILED
+} TrackState;
+
+typedef struct {
+	GtkTreeIter iter;
+	TrackState state;
+	gint bytes;
+	gint length;
+	bool dirty;
+} TrackRow;
+
+GtkWidget *window, *album, *albumprogress;
+GtkListStore *store;
+
+static AMZDownloadSession *session;
+static GPtrArray *rows, *dirty_rows;
+static guint tracks = 0, completed = 0, failed = 0;
+static bool totals_dirty = true;
 
 static void
-handle_progress(SoupMessage *msg, AMZDownloadContext *ctx)
+mark_dirty(TrackRow *row)
 {
-	static gint t = 0;
-	gchar *progress;
-
-	if (++t % 100 != 0 && ctx->progress > 1 && ctx->progress < 100)
+	if (row->dirty)
 		return;
 
-	progress = g_strdup_printf("%d / %d bytes, %.2f percent complete",
-				    ctx->bytes, ctx->length, ctx->progress);
+	row->dirty = true;
+	g_ptr_array_add(dirty_rows, row);
+}
+
+static void
+handle_progress(AMZDownloadContext *ctx)
+{
+	TrackRow *row = ctx->userdata;
+
+	row->state = TRACK_ACTIVE;
+	row->bytes = ctx->bytes;
+	row->length = ctx->length;
+	mark_dirty(row);
+}
+
+static void
+handle_finished(AMZDownloadContext *ctx)
+{
+	TrackRow *row = ctx->userdata;
+
+	row->state = ctx->success ? TRACK_DONE : TRACK_FAILED;
+	mark_dirty(row);
+
+	completed++;
+	if (!ctx->success)
+		failed++;
+	totals_dirty = true;
+}
+
+static void
+flush_row(TrackRow *row)
+{
+	gchar status[64];
+	gint percent = 0;
+
+	switch (row->state)
+	{
+	case TRACK_QUEUED:
+		g_strlcpy(status, "Queued", sizeof status);
+		break;
+	case TRACK_ACTIVE:
+		if (row->length > 0)
+			percent = (gint) ((gint64) row->bytes * 100 / row->length);
+		g_snprintf(status, sizeof status, "%d / %d KiB", row->bytes / 1024, row->length / 1024);
+		break;
+	case TRACK_DONE:
+		percent = 100;
+		g_strlcpy(status, "Done", sizeof status);
+		break;
+	case TRACK_FAILED:
+		g_strlcpy(status, "Failed", sizeof status);
+		break;
+	}
+
+	gtk_list_store_set(store, &row->iter, COL_PROGRESS, percent, COL_STATUS, status, -1);
+	row->dirty = false;
+}
+
+static void
+flush_totals(void)
+{
+	gchar status[64];
+
+	if (failed > 0)
+		g_snprintf(status, sizeof status, "%u / %u tracks, %u failed", completed, tracks, failed);
+	else
+		g_snprintf(status, sizeof status, "%u / %u tracks", completed, tracks);
+
+	gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(albumprogress), tracks ? (gdouble) completed / tracks : 1.);
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(albumprogress), status);
+
+	totals_dirty = false;
+}
+
+static gboolean
+tick(gpointer userdata)
+{
+	bool running;
+	guint i;
+
+	running = amzdownload_session_dispatch(session);
+
+	for (i = 0; i < dirty_rows->len; i++)
+		flush_row(g_ptr_array_index(dirty_rows, i));
+	g_ptr_array_set_size(dirty_rows, 0);
+
+	if (totals_dirty)
+		flush_totals();
+
+	if (!running)
+	{
+		gtk_main_quit();
+		return FALSE;
+	}
 
-	gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(songprogress), ctx->progress / 100.);
-	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(songprogress), progress);
+	return TRUE;
 }
 
 gchar *
@@ -55,102 +183,103 @@ build_download_path(AMZPlaylistEntry *entry)
 
 	g_mkdir_with_parents(dir, 0755);
 
+	g_free(filename);
 	g_free(dir);
 
 	return ret;
 }
 
 void
-handle_amz_file(SoupSession *session, const gchar *file)
+handle_amz_file(AMZDownloadSession *session, const gchar *file)
 {
 	GList *list, *node;
 	guchar *data;
-	gsize len, tracks;
-	gint i = 1;
+	gsize len;
 
 	g_return_if_fail(file != NULL);
 
-	amzfile_decrypt_file(file, &data, &len);
-	list = amzplaylist_parse(data);
-	if (list == NULL)
+	if (!amzfile_decrypt_file(file, &data, &len) || (list = amzplaylist_parse(data)) == NULL)
 	{
 		fprintf(stderr, "failed to parse xspf file embedded in %s\n", file);
 		exit(EXIT_FAILURE);
 	}
+	g_free(data);
 
-	{
-		gchar *albumtext, *creator, *markup;
-		AMZPlaylistEntry *entry = list->data;
-
-		albumtext = g_markup_escape_text(entry->album, -1);
-		creator = g_markup_escape_text(entry->creator, -1);
-		markup = g_strdup_printf("<big>Downloading <b>%s</b> by <b>%s</b></big>", albumtext, creator);
-		gtk_label_set_markup(GTK_LABEL(album), markup);
-
-		g_free(albumtext);
-		g_free(creator);
-		g_free(markup);
-
-		markup = g_strdup_printf("gtkamzdl: %s by %s", entry->album, entry->creator);
-		gtk_window_set_title(GTK_WINDOW(window), markup);
-		g_free(markup);
-	}
-
-	tracks = g_list_length(list);
 	for (node = list; node != NULL; node = node->next)
 	{
-		gchar *title, *markup, *status;
-		gchar *path;
+		gchar *path, *albumtext;
 		AMZPlaylistEntry *entry = node->data;
+		TrackRow *row;
 
 		path = build_download_path(entry);
+		albumtext = g_strdup_printf("%s - %s", entry->creator, entry->album);
 
-		title = g_markup_escape_text(entry->title, -1);
-		markup = g_strdup_printf("<b>%s</b>", title);
+		row = g_slice_new0(TrackRow);
+		g_ptr_array_add(rows, row);
+		gtk_list_store_append(store, &row->iter);
+		gtk_list_store_set(store, &row->iter, COL_TRACK, entry->title, COL_ALBUM, albumtext, -1);
+		mark_dirty(row);
 
-		gtk_label_set_markup(GTK_LABEL(song), title);
+		amzdownload_session_queue_url(session, entry->location, path, handle_progress, handle_finished, row);
+		tracks++;
 
-		g_free(title);
-		g_free(markup);
+		g_free(albumtext);
+		g_free(path);
+	}
 
-		status = g_strdup_printf("%d / %lu tracks", i, tracks);
-		gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(albumprogress), ((float) i / (float) tracks));
-		gtk_progress_bar_set_text(GTK_PROGRESS_BAR(albumprogress), status);
-		g_free(status);
+	amzplaylist_free(list);
+}
 
-		amzdownload_session_download_url(session, entry->location, path, handle_progress);
+static GtkTreeViewColumn *
+add_column(GtkWidget *view, const gchar *title, GtkCellRenderer *renderer, const gchar *attribute,
+	   gint column, gint width)
+{
+	GtkTreeViewColumn *col;
 
-		g_free(path);
+	col = gtk_tree_view_column_new_with_attributes(title, renderer, attribute, column, NULL);
+	gtk_tree_view_column_set_sizing(col, GTK_TREE_VIEW_COLUMN_FIXED);
+	gtk_tree_view_column_set_fixed_width(col, width);
+	gtk_tree_view_column_set_resizable(col, TRUE);
+	gtk_tree_view_append_column(GTK_TREE_VIEW(view), col);
 
-		i++;
-	}
+	return col;
 }
 
 void
 build_window(void)
 {
-	GtkWidget *vbox;
+	GtkWidget *vbox, *scroll, *view;
 
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_title(GTK_WINDOW(window), "gtkamzdl");
-	gtk_window_set_resizable(GTK_WINDOW(window), FALSE);
+	gtk_window_set_default_size(GTK_WINDOW(window), 640, 400);
 	gtk_window_set_deletable(GTK_WINDOW(window), FALSE);
 	gtk_container_set_border_width(GTK_CONTAINER(window), 10);
 
 	vbox = gtk_vbox_new(FALSE, 5);
 	gtk_container_add(GTK_CONTAINER(window), vbox);
 
-	album = gtk_label_new("album");
-	gtk_box_pack_start(GTK_BOX(vbox), album, TRUE, TRUE, 0);
+	album = gtk_label_new(NULL);
+	gtk_label_set_markup(GTK_LABEL(album), "<big>Downloading</big>");
+	gtk_misc_set_alignment(GTK_MISC(album), 0, 0.5);
+	gtk_box_pack_start(GTK_BOX(vbox), album, FALSE, FALSE, 0);
 
-	song = gtk_label_new("song");
-	gtk_box_pack_start(GTK_BOX(vbox), song, TRUE, TRUE, 0);
+	store = gtk_list_store_new(N_COLUMNS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT, G_TYPE_STRING);
 
-	albumprogress = gtk_progress_bar_new();
-	gtk_box_pack_start(GTK_BOX(vbox), albumprogress, TRUE, TRUE, 0);
+	view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
+	add_column(view, "Track", gtk_cell_renderer_text_new(), "text", COL_TRACK, 200);
+	add_column(view, "Album", gtk_cell_renderer_text_new(), "text", COL_ALBUM, 180);
+	add_column(view, "Progress", gtk_cell_renderer_progress_new(), "value", COL_PROGRESS, 100);
+	add_column(view, "Status", gtk_cell_renderer_text_new(), "text", COL_STATUS, 120);
+	gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(view), TRUE);
+
+	scroll = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(scroll), view);
+	gtk_box_pack_start(GTK_BOX(vbox), scroll, TRUE, TRUE, 0);
 
-	songprogress = gtk_progress_bar_new();
-	gtk_box_pack_start(GTK_BOX(vbox), songprogress, TRUE, TRUE, 0);
+	albumprogress = gtk_progress_bar_new();
+	gtk_box_pack_start(GTK_BOX(vbox), albumprogress, FALSE, FALSE, 0);
 
 	g_signal_connect(window, "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), NULL);
 
@@ -160,22 +289,40 @@ build_window(void)
 int
 main(gint argc, gchar *argv[])
 {
-	SoupSession *session;
+	gchar *markup;
 	gint i;
 
 	gtk_init(&argc, &argv);
 
-	session = amzdownload_session_new();
-
 	if (argc < 2)
 	{
 		fprintf(stderr, "usage: %s file.amz\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
+	session = amzdownload_session_new();
+	rows = g_ptr_array_new();
+	dirty_rows = g_ptr_array_new();
+
 	build_window();
 	for (i = 1; i < argc; i++)
 		handle_amz_file(session, argv[i]);
 
-	return EXIT_SUCCESS;
+	markup = g_strdup_printf("<big>Downloading <b>%u</b> track%s</big>", tracks, tracks != 1 ? "s" : "");
+	gtk_label_set_markup(GTK_LABEL(album), markup);
+	g_free(markup);
+
+	flush_totals();
+	g_timeout_add(TICK_INTERVAL, tick, NULL);
+
+	gtk_main();
+
+	amzdownload_session_free(session);
+
+	for (i = 0; i < rows->len; i++)
+		g_slice_free(TrackRow, g_ptr_array_index(rows, i));
+	g_ptr_array_free(rows, TRUE);
+	g_ptr_array_free(dirty_rows, TRUE);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -107,6 +107,7 @@ amzfile_decrypt_blob(gchar *indata, gsize inlen, guchar **outdata, gsize *outlen
 	decryptdata[i] = 0;
 
 	*outdata = decryptdata;
+	*outlen = i;
 	return true;
 }
 
@@ -125,6 +126,7 @@ amzfile_decrypt_file(const gchar *file, guchar **outdata, gsize *outlen)
 	if (!g_file_get_contents(file, &b64data, &b64len, &error))
 	{
 		g_print("cannot open %s: %s", file, error->message);
+		g_error_free(error);
 		return false;
 	}
 
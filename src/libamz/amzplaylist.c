@@ -23,6 +23,7 @@
 
 #include <glib.h>
 #include <gcrypt.h>
+#include <string.h>
 
 #include "libamz.h"
 
@@ -36,6 +37,452 @@
 #define XSPF_ROOT_NODE_NAME "playlist"
 #define XSPF_XMLNS "http://xspf.org/ns/0/"
 
+static gchar *
+amzplaylist_node_content(xmlNodePtr node)
+{
+	xmlChar *content;
+	gchar *ret;
+
+	content = xmlNodeGetContent(node);
+	ret = g_strdup((gchar *) content);
+	xmlFree(content);
+
+	return ret;
+}
+
+static gint64
+amzplaylist_node_number(xmlNodePtr node)
+{
+	xmlChar *content;
+	gint64 ret;
+
+	content = xmlNodeGetContent(node);
+	ret = content != NULL ? g_ascii_strtoll((gchar *) content, NULL, 10) : 0;
+	xmlFree(content);
+
+	return ret;
+}
+
+/*
+ * Track filters.
+ *
+ * A filter expression is a whitespace-separated list of clauses, all of
+ * which must hold for a track to be kept.  A clause is a field name, an
+ * operator and a value, e.g.
+ *
+ *     disc=2 deluxe=1 type=flac 'title~*Live*' tracknum<=10
+ *
+ * Operators are = and != (with comma-separated alternatives), ~ and !~
+ * (glob patterns) and <, <=, >, >= for the numeric fields.  String
+ * comparisons and patterns both ignore case.  Shell-style quoting may be
+ * used to put spaces inside values.
+ *
+ * The expression is compiled once and evaluated by the parser directly
+ * against the track's XML node, so rejected tracks never have their
+ * strings copied.  Clauses on `deluxe' are also checked up front, letting
+ * the parser skip a whole trackList that can never match.
+ */
+typedef enum {
+	AMZPLAYLIST_FIELD_TITLE,
+	AMZPLAYLIST_FIELD_CREATOR,
+	AMZPLAYLIST_FIELD_ALBUM,
+	AMZPLAYLIST_FIELD_TRACKNUM,
+	AMZPLAYLIST_FIELD_DURATION,
+	AMZPLAYLIST_FIELD_TYPE,
+	AMZPLAYLIST_FIELD_DISC,
+	AMZPLAYLIST_FIELD_DELUXE,
+	AMZPLAYLIST_FIELD_COUNT
+} AMZPlaylistField;
+
+static const struct {
+	const gchar *name;
+	const gchar *element;
+	const gchar *rel;
+	const gchar *fallback;
+	bool numeric;
+} amzplaylist_fields[AMZPLAYLIST_FIELD_COUNT] = {
+	{ "title", "title", NULL, "", false },
+	{ "creator", "creator", NULL, "", false },
+	{ "album", "album", NULL, "", false },
+	{ "tracknum", "trackNum", NULL, "0", true },
+	{ "duration", "duration", NULL, "0", true },
+	{ "type", NULL, "http://www.amazon.com/dmusic/trackType", "mp3", false },
+	{ "disc", NULL, "http://www.amazon.com/dmusic/discNum", "1", true },
+	{ "deluxe", NULL, NULL, "0", true },
+};
+
+typedef enum {
+	AMZPLAYLIST_OP_EQ,
+	AMZPLAYLIST_OP_NE,
+	AMZPLAYLIST_OP_MATCH,
+	AMZPLAYLIST_OP_NOMATCH,
+	AMZPLAYLIST_OP_LT,
+	AMZPLAYLIST_OP_LE,
+	AMZPLAYLIST_OP_GT,
+	AMZPLAYLIST_OP_GE
+} AMZPlaylistOp;
+
+/* longest operators first, so that "<=" is not taken for "<" */
+static const struct {
+	const gchar *text;
+	AMZPlaylistOp op;
+} amzplaylist_ops[] = {
+	{ "!=", AMZPLAYLIST_OP_NE },
+	{ "!~", AMZPLAYLIST_OP_NOMATCH },
+	{ "<=", AMZPLAYLIST_OP_LE },
+	{ ">=", AMZPLAYLIST_OP_GE },
+	{ "=", AMZPLAYLIST_OP_EQ },
+	{ "~", AMZPLAYLIST_OP_MATCH },
+	{ "<", AMZPLAYLIST_OP_LT },
+	{ ">", AMZPLAYLIST_OP_GT },
+};
+
+typedef struct {
+	AMZPlaylistField field;
+	AMZPlaylistOp op;
+	gchar **values;
+	gint64 *numbers;
+	guint count;
+	GPatternSpec *pattern;
+} AMZPlaylistClause;
+
+struct _AMZPlaylistFilter {
+	GSList *clauses;
+	guint fields;
+	bool skip_main;
+	bool skip_deluxe;
+};
+
+GQuark
+amzplaylist_filter_error_quark(void)
+{
+	return g_quark_from_static_string("amzplaylist-filter-error-quark");
+}
+
+static bool
+amzplaylist_clause_match(const AMZPlaylistClause *clause, const gchar *value)
+{
+	gint64 number;
+	gchar *folded;
+	bool ret;
+	guint i;
+
+	if (value == NULL)
+		value = amzplaylist_fields[clause->field].fallback;
+
+	/* the pattern was casefolded when it was compiled. */
+	if (clause->op == AMZPLAYLIST_OP_MATCH || clause->op == AMZPLAYLIST_OP_NOMATCH)
+	{
+		folded = g_utf8_casefold(value, -1);
+		ret = g_pattern_match_string(clause->pattern, folded);
+		g_free(folded);
+
+		return clause->op == AMZPLAYLIST_OP_MATCH ? ret : !ret;
+	}
+
+	/* so were the values of = and !=, the only operators on strings. */
+	if (!amzplaylist_fields[clause->field].numeric)
+	{
+		folded = g_utf8_casefold(value, -1);
+		for (i = 0; i < clause->count && strcmp(folded, clause->values[i]); i++)
+			;
+		g_free(folded);
+
+		return (i < clause->count) == (clause->op == AMZPLAYLIST_OP_EQ);
+	}
+
+	number = g_ascii_strtoll(value, NULL, 10);
+
+	switch (clause->op)
+	{
+	case AMZPLAYLIST_OP_EQ:
+	case AMZPLAYLIST_OP_NE:
+		for (i = 0; i < clause->count; i++)
+		{
+			if (number == clause->numbers[i])
+				return clause->op == AMZPLAYLIST_OP_EQ;
+		}
+
+		return clause->op == AMZPLAYLIST_OP_NE;
+	case AMZPLAYLIST_OP_LT:
+		return number < clause->numbers[0];
+	case AMZPLAYLIST_OP_LE:
+		return number <= clause->numbers[0];
+	case AMZPLAYLIST_OP_GT:
+		return number > clause->numbers[0];
+	case AMZPLAYLIST_OP_GE:
+		return number >= clause->numbers[0];
+	default:
+		return false;
+	}
+}
+
+static void
+amzplaylist_clause_free(AMZPlaylistClause *clause)
+{
+	g_strfreev(clause->values);
+	g_free(clause->numbers);
+
+	if (clause->pattern != NULL)
+		g_pattern_spec_free(clause->pattern);
+
+	g_slice_free(AMZPlaylistClause, clause);
+}
+
+static AMZPlaylistClause *
+amzplaylist_clause_compile(const gchar *text, GError **error)
+{
+	AMZPlaylistClause *clause;
+	const gchar *p;
+	gchar *name, *folded;
+	guint i;
+
+	for (p = text; g_ascii_isalpha(*p); p++)
+		;
+
+	name = g_strndup(text, p - text);
+	for (i = 0; i < AMZPLAYLIST_FIELD_COUNT; i++)
+	{
+		if (!g_ascii_strcasecmp(name, amzplaylist_fields[i].name))
+			break;
+	}
+
+	g_free(name);
+
+	if (i == AMZPLAYLIST_FIELD_COUNT)
+	{
+		g_set_error(error, AMZPLAYLIST_FILTER_ERROR, AMZPLAYLIST_FILTER_ERROR_PARSE,
+			    "unknown field in filter clause '%s'", text);
+		return NULL;
+	}
+
+	clause = g_slice_new0(AMZPlaylistClause);
+	clause->field = i;
+
+	for (i = 0; i < G_N_ELEMENTS(amzplaylist_ops); i++)
+	{
+		if (g_str_has_prefix(p, amzplaylist_ops[i].text))
+			break;
+	}
+
+	if (i == G_N_ELEMENTS(amzplaylist_ops))
+	{
+		g_set_error(error, AMZPLAYLIST_FILTER_ERROR, AMZPLAYLIST_FILTER_ERROR_PARSE,
+			    "missing operator in filter clause '%s'", text);
+		amzplaylist_clause_free(clause);
+		return NULL;
+	}
+
+	clause->op = amzplaylist_ops[i].op;
+	p += strlen(amzplaylist_ops[i].text);
+
+	if (clause->op == AMZPLAYLIST_OP_MATCH || clause->op == AMZPLAYLIST_OP_NOMATCH)
+	{
+		folded = g_utf8_casefold(p, -1);
+		clause->pattern = g_pattern_spec_new(folded);
+		g_free(folded);
+
+		return clause;
+	}
+
+	if (clause->op == AMZPLAYLIST_OP_EQ || clause->op == AMZPLAYLIST_OP_NE)
+	{
+		clause->values = g_strsplit(p, ",", 0);
+
+		if (!amzplaylist_fields[clause->field].numeric)
+		{
+			for (i = 0; clause->values[i] != NULL; i++)
+			{
+				folded = g_utf8_casefold(clause->values[i], -1);
+				g_free(clause->values[i]);
+				clause->values[i] = folded;
+			}
+		}
+	}
+	else
+	{
+		if (!amzplaylist_fields[clause->field].numeric)
+		{
+			g_set_error(error, AMZPLAYLIST_FILTER_ERROR, AMZPLAYLIST_FILTER_ERROR_PARSE,
+				    "field '%s' cannot be compared numerically", amzplaylist_fields[clause->field].name);
+			amzplaylist_clause_free(clause);
+			return NULL;
+		}
+
+		clause->values = g_new0(gchar *, 2);
+		clause->values[0] = g_strdup(p);
+	}
+
+	clause->count = g_strv_length(clause->values);
+
+	/* "disc=" or "type=a,,b" would otherwise quietly never match. */
+	for (i = 0; i < clause->count && *clause->values[i] != '\0'; i++)
+		;
+
+	if (clause->count == 0 || i < clause->count)
+	{
+		g_set_error(error, AMZPLAYLIST_FILTER_ERROR, AMZPLAYLIST_FILTER_ERROR_PARSE,
+			    "empty value in filter clause '%s'", text);
+		amzplaylist_clause_free(clause);
+		return NULL;
+	}
+
+	if (amzplaylist_fields[clause->field].numeric)
+	{
+		clause->numbers = g_new0(gint64, clause->count);
+		for (i = 0; i < clause->count; i++)
+		{
+			gchar *end;
+
+			clause->numbers[i] = g_ascii_strtoll(clause->values[i], &end, 10);
+			if (*clause->values[i] == '\0' || *end != '\0')
+			{
+				g_set_error(error, AMZPLAYLIST_FILTER_ERROR, AMZPLAYLIST_FILTER_ERROR_PARSE,
+					    "'%s' is not a number in filter clause '%s'", clause->values[i], text);
+				amzplaylist_clause_free(clause);
+				return NULL;
+			}
+		}
+	}
+
+	return clause;
+}
+
+AMZPlaylistFilter *
+amzplaylist_filter_new(const gchar *expr, GError **error)
+{
+	AMZPlaylistFilter *filter;
+	gchar **argv;
+	gint argc, i;
+	GSList *node;
+
+	g_return_val_if_fail(expr != NULL, NULL);
+
+	if (!g_shell_parse_argv(expr, &argc, &argv, error))
+		return NULL;
+
+	filter = g_slice_new0(AMZPlaylistFilter);
+
+	for (i = 0; i < argc; i++)
+	{
+		AMZPlaylistClause *clause;
+
+		clause = amzplaylist_clause_compile(argv[i], error);
+		if (clause == NULL)
+		{
+			g_strfreev(argv);
+			amzplaylist_filter_free(filter);
+			return NULL;
+		}
+
+		filter->clauses = g_slist_append(filter->clauses, clause);
+		filter->fields |= 1 << clause->field;
+	}
+
+	g_strfreev(argv);
+
+	/* work out now whether either kind of trackList can match at all */
+	for (node = filter->clauses; node != NULL; node = node->next)
+	{
+		AMZPlaylistClause *clause = node->data;
+
+		if (clause->field != AMZPLAYLIST_FIELD_DELUXE)
+			continue;
+
+		if (!amzplaylist_clause_match(clause, "0"))
+			filter->skip_main = true;
+		if (!amzplaylist_clause_match(clause, "1"))
+			filter->skip_deluxe = true;
+	}
+
+	return filter;
+}
+
+void
+amzplaylist_filter_free(AMZPlaylistFilter *filter)
+{
+	g_return_if_fail(filter != NULL);
+
+	g_slist_foreach(filter->clauses, (GFunc) amzplaylist_clause_free, NULL);
+	g_slist_free(filter->clauses);
+	g_slice_free(AMZPlaylistFilter, filter);
+}
+
+/*
+ * Returns the text of an element without copying it when it is a single
+ * text node, which is the case for everything Amazon writes.  Anything
+ * else is flattened by libxml2 and queued on scratch for the caller to free.
+ */
+static const gchar *
+amzplaylist_node_text(xmlNodePtr node, GSList **scratch)
+{
+	xmlNodePtr child = node->children;
+	xmlChar *content;
+
+	if (child == NULL)
+		return "";
+
+	if (child->next == NULL && (child->type == XML_TEXT_NODE || child->type == XML_CDATA_SECTION_NODE))
+		return (const gchar *) child->content;
+
+	content = xmlNodeGetContent(node);
+	*scratch = g_slist_prepend(*scratch, content);
+
+	return (const gchar *) content;
+}
+
+static bool
+amzplaylist_filter_match_track(const AMZPlaylistFilter *filter, xmlNodePtr track, bool deluxe)
+{
+	const gchar *values[AMZPLAYLIST_FIELD_COUNT] = { NULL };
+	GSList *scratch = NULL, *node;
+	xmlNodePtr nptr;
+	bool ret = true;
+	guint i;
+
+	for (nptr = track->children; nptr != NULL; nptr = nptr->next)
+	{
+		xmlAttrPtr rel = NULL;
+
+		if (nptr->type != XML_ELEMENT_NODE)
+			continue;
+
+		if (!xmlStrcmp(nptr->name, (xmlChar *) "meta"))
+		{
+			rel = xmlHasProp(nptr, (xmlChar *) "rel");
+			if (rel == NULL || rel->children == NULL || rel->children->content == NULL)
+				continue;
+		}
+
+		for (i = 0; i < AMZPLAYLIST_FIELD_COUNT; i++)
+		{
+			if (!(filter->fields & (1 << i)) || values[i] != NULL)
+				continue;
+
+			if (rel != NULL ? amzplaylist_fields[i].rel != NULL && !xmlStrcmp(rel->children->content, (xmlChar *) amzplaylist_fields[i].rel)
+					: amzplaylist_fields[i].element != NULL && !xmlStrcmp(nptr->name, (xmlChar *) amzplaylist_fields[i].element))
+			{
+				values[i] = amzplaylist_node_text(nptr, &scratch);
+				break;
+			}
+		}
+	}
+
+	values[AMZPLAYLIST_FIELD_DELUXE] = deluxe ? "1" : "0";
+
+	for (node = filter->clauses; node != NULL && ret; node = node->next)
+	{
+		AMZPlaylistClause *clause = node->data;
+
+		ret = amzplaylist_clause_match(clause, values[clause->field]);
+	}
+
+	g_slist_foreach(scratch, (GFunc) xmlFree, NULL);
+	g_slist_free(scratch);
+
+	return ret;
+}
+
 static AMZPlaylistEntry *
 amzplaylist_parse_track(xmlNodePtr track, xmlChar *base)
 {
@@ -49,26 +496,30 @@ amzplaylist_parse_track(xmlNodePtr track, xmlChar *base)
 		if (nptr->type == XML_ELEMENT_NODE)
 		{
 			if (!xmlStrcmp(nptr->name, (xmlChar *)"location"))
-				entry->location = g_strdup((gchar *) xmlNodeGetContent(nptr));
+				entry->location = amzplaylist_node_content(nptr);
 			else if (!xmlStrcmp(nptr->name, (xmlChar *)"creator"))
-				entry->creator = g_strdup((gchar *) xmlNodeGetContent(nptr));
+				entry->creator = amzplaylist_node_content(nptr);
 			else if (!xmlStrcmp(nptr->name, (xmlChar *)"album"))
-				entry->album = g_strdup((gchar *) xmlNodeGetContent(nptr));
+				entry->album = amzplaylist_node_content(nptr);
 			else if (!xmlStrcmp(nptr->name, (xmlChar *)"title"))
-				entry->title = g_strdup((gchar *) xmlNodeGetContent(nptr));
+				entry->title = amzplaylist_node_content(nptr);
 			else if (!xmlStrcmp(nptr->name, (xmlChar *)"trackNum"))
-				entry->tracknum = atol((gchar *) xmlNodeGetContent(nptr));
+				entry->tracknum = amzplaylist_node_number(nptr);
 			else if (!xmlStrcmp(nptr->name, (xmlChar *)"duration"))
-				entry->duration = atol((gchar *) xmlNodeGetContent(nptr));
+				entry->duration = amzplaylist_node_number(nptr);
 			else if (!xmlStrcmp(nptr->name, (xmlChar *)"meta"))
 			{
 				xmlChar *property;
 
+				property = xmlGetProp(nptr, (xmlChar *) "rel");
+				if (property == NULL)
+					continue;
+
 				if (entry->meta == NULL)
-					entry->meta = g_hash_table_new(g_str_hash, g_str_equal);
+					entry->meta = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 
-				property = xmlGetProp(nptr, (xmlChar *) "rel");
-				g_hash_table_insert(entry->meta, property, g_strdup((gchar *) xmlNodeGetContent(nptr)));
+				g_hash_table_insert(entry->meta, g_strdup((gchar *) property), amzplaylist_node_content(nptr));
+				xmlFree(property);
 			}
 		}
 	}
@@ -76,36 +527,46 @@ amzplaylist_parse_track(xmlNodePtr track, xmlChar *base)
 	return entry;	
 }
 
-static GList *
-amzplaylist_parse_tracklist(GList *list, xmlNodePtr tracklist, xmlChar *base)
+static void
+amzplaylist_parse_tracklist(xmlNodePtr tracklist, xmlChar *base, const AMZPlaylistFilter *filter, bool deluxe,
+			    AMZPlaylistFunc func, gpointer userdata)
 {
 	xmlNodePtr nptr;
-	AMZPlaylistEntry *entry;
+
+	if (filter != NULL && (deluxe ? filter->skip_deluxe : filter->skip_main))
+		return;
 
 	for (nptr = tracklist->children; nptr != NULL; nptr = nptr->next)
 	{
 		if (nptr->type == XML_ELEMENT_NODE && !xmlStrcmp (nptr->name, (xmlChar *) "track"))
 		{
-			entry = amzplaylist_parse_track(nptr, base);
-			list = g_list_prepend(list, entry);
+			if (filter != NULL && !amzplaylist_filter_match_track(filter, nptr, deluxe))
+				continue;
+
+			func(amzplaylist_parse_track(nptr, base), userdata);
 		}
 	}
-
-	return g_list_reverse(list);
 }
 
-GList *
-amzplaylist_parse(const guchar *indata)
+/*
+ * Parses indata, handing each track that passes filter (which may be NULL)
+ * to func in document order as soon as it is built.  func owns the entry.
+ * Returns false if indata is not a playlist at all.
+ */
+bool
+amzplaylist_parse_foreach(const guchar *indata, const AMZPlaylistFilter *filter, AMZPlaylistFunc func, gpointer userdata)
 {
 	xmlDocPtr doc;
 	xmlNodePtr nptr, nptr2;
-	GList *ret = NULL;
+	bool found = false;
+
+	g_return_val_if_fail(func != NULL, false);
 
 	doc = xmlRecoverDoc(indata);
 	if (doc == NULL)
 	{
 		fprintf(stderr, "xmlRecoverDoc is NULL\n");
-        	return NULL;
+        	return false;
 	}
 
 	for (nptr = doc->children; nptr != NULL; nptr = nptr->next)
@@ -114,6 +575,7 @@ amzplaylist_parse(const guchar *indata)
 		{
 			xmlChar *base;
 
+			found = true;
 			base = xmlNodeGetBase(doc, nptr);
 			for (nptr2 = nptr->children; nptr2 != NULL; nptr2 = nptr2->next)
 			{
@@ -121,7 +583,7 @@ amzplaylist_parse(const guchar *indata)
 					continue;
 
 				if (!xmlStrcmp(nptr2->name, (xmlChar *) "trackList"))
-					ret = amzplaylist_parse_tracklist(ret, nptr2, base);
+					amzplaylist_parse_tracklist(nptr2, base, filter, false, func, userdata);
 				else if (!xmlStrcmp(nptr2->name, (xmlChar *) "extension"))
 				{
 					xmlNodePtr nptr3;
@@ -140,26 +602,66 @@ amzplaylist_parse(const guchar *indata)
 							for (nptr4 = nptr3->children; nptr4 != NULL; nptr4 = nptr4->next)
 							{
 								if (nptr4->type == XML_ELEMENT_NODE && !xmlStrcmp(nptr4->name, (xmlChar *) "trackList"))
-									ret = amzplaylist_parse_tracklist(ret, nptr4, child);
+									amzplaylist_parse_tracklist(nptr4, child, filter, true, func, userdata);
 							}
+
+							xmlFree(child);
 						}
 					}
 				}
 			}
+
+			xmlFree(base);
 		}
 	}
 
-	return ret;
+	xmlFreeDoc(doc);
+
+	/* xmlRecoverDoc() makes a document of almost anything. */
+	return found;
 }
 
 static void
-amzplaylist_free_entry(AMZPlaylistEntry *entry, gpointer userdata)
+amzplaylist_collect(AMZPlaylistEntry *entry, gpointer userdata)
+{
+	GList **list = userdata;
+
+	*list = g_list_prepend(*list, entry);
+}
+
+bool
+amzplaylist_parse_filtered(const guchar *indata, const AMZPlaylistFilter *filter, GList **out)
+{
+	GList *ret = NULL;
+	bool ok;
+
+	ok = amzplaylist_parse_foreach(indata, filter, amzplaylist_collect, &ret);
+	*out = g_list_reverse(ret);
+
+	return ok;
+}
+
+GList *
+amzplaylist_parse(const guchar *indata)
+{
+	GList *ret;
+
+	amzplaylist_parse_filtered(indata, NULL, &ret);
+
+	return ret;
+}
+
+void
+amzplaylist_entry_free(AMZPlaylistEntry *entry)
 {
 	g_free(entry->location);
 	g_free(entry->creator);
 	g_free(entry->album);
 	g_free(entry->title);
 
+	if (entry->meta != NULL)
+		g_hash_table_destroy(entry->meta);
+
 	g_slice_free(AMZPlaylistEntry, entry);
 }
 
@@ -168,6 +670,6 @@ amzplaylist_free(GList *playlist)
 {
 	g_return_if_fail(playlist != NULL);
 
-	g_list_foreach(playlist, (GFunc) amzplaylist_free_entry, NULL);
+	g_list_foreach(playlist, (GFunc) amzplaylist_entry_free, NULL);
 	g_list_free(playlist);
 }
@@ -24,8 +24,6 @@
 #include <glib.h>
 #include <gcrypt.h>
 
-#include <libsoup/soup.h>
-
 #include <stddef.h>
 #include <stdbool.h>
 
@@ -47,23 +45,23 @@ typedef struct {
 	GHashTable *meta;
 } AMZPlaylistEntry;
 
-extern GList *amzplaylist_parse(const guchar *indata);
-extern void amzplaylist_free(GList *playlist);
+typedef struct _AMZPlaylistFilter AMZPlaylistFilter;
+typedef void (*AMZPlaylistFunc)(AMZPlaylistEntry *entry, gpointer userdata);
 
-/* amzdownload */
-typedef struct _AMZDownloadContext AMZDownloadContext;
+#define AMZPLAYLIST_FILTER_ERROR amzplaylist_filter_error_quark()
 
-struct _AMZDownloadContext {
-	SoupMessage *msg;
-	gint length;
-	gint bytes;
-	gfloat progress;
+typedef enum {
+	AMZPLAYLIST_FILTER_ERROR_PARSE
+} AMZPlaylistFilterError;
 
-	void (*progress_notify)(SoupMessage *msg, AMZDownloadContext *ctx);
-};
+extern GList *amzplaylist_parse(const guchar *indata);
+extern bool amzplaylist_parse_foreach(const guchar *indata, const AMZPlaylistFilter *filter, AMZPlaylistFunc func, gpointer userdata);
+extern bool amzplaylist_parse_filtered(const guchar *indata, const AMZPlaylistFilter *filter, GList **out);
+extern void amzplaylist_free(GList *playlist);
+extern void amzplaylist_entry_free(AMZPlaylistEntry *entry);
 
-SoupSession *amzdownload_session_new(void);
-bool amzdownload_session_download_url(SoupSession *session, const gchar *url, const gchar *path,
-	void (*progress_notify)(SoupMessage *msg, AMZDownloadContext *context));
+extern GQuark amzplaylist_filter_error_quark(void);
+extern AMZPlaylistFilter *amzplaylist_filter_new(const gchar *expr, GError **error);
+extern void amzplaylist_filter_free(AMZPlaylistFilter *filter);
 
 #endif
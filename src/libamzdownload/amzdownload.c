@@ -0,0 +1,763 @@
+/*
+ * libamz: library for accessing, manipulating and decrypting amz files.
+ * amzdownload.c: utility functions for downloading files.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "amzdownload.h"
+#include "amztransport.h"
+
+/*
+ * Hedged requests.
+ *
+ * Some CDN edges stall for a long time before sending the first byte, or
+ * trickle the body out far slower than usual.  When hedging is enabled, a
+ * transfer which has not started after the session's observed p95 time to
+ * first byte (or which falls below the session's p5 throughput) gets a
+ * duplicate request.  Whichever copy makes progress first wins and the other
+ * is cancelled.  Duplicates are capped at a fraction (at most half) of
+ * the transfers started on the session, plus a burst of one, so beyond
+ * that one hedging adds at most half as much load again.
+ */
+#define AMZDOWNLOAD_SAMPLES		64
+#define AMZDOWNLOAD_MIN_SAMPLES		4
+#define AMZDOWNLOAD_DEFAULT_TTFB	2.0
+#define AMZDOWNLOAD_MIN_TTFB		0.25
+#define AMZDOWNLOAD_RATE_WINDOW		1.0
+#define AMZDOWNLOAD_CHECK_INTERVAL	100
+#define AMZDOWNLOAD_HEDGE_BURST		1
+#define AMZDOWNLOAD_HEDGE_RATIO		0.1
+#define AMZDOWNLOAD_HEDGE_MAX_RATIO	0.5
+
+#define AMZDOWNLOAD_MAX_TRANSFERS	4
+
+typedef struct {
+	gdouble values[AMZDOWNLOAD_SAMPLES];
+	guint count;
+	guint next;
+} AMZDownloadSamples;
+
+typedef struct {
+	bool hedging;
+	gdouble hedge_ratio;
+	guint transfers;
+	guint hedges;
+	AMZDownloadSamples ttfb;
+	AMZDownloadSamples rate;
+} AMZDownloadStats;
+
+struct _AMZDownloadSession {
+	AMZTransport *transport;
+	AMZDownloadStats stats;
+	guint max_transfers;
+	GQueue *queued;
+	GList *active;
+	guint nactive;
+};
+
+typedef struct _AMZDownloadTransfer AMZDownloadTransfer;
+
+typedef struct {
+	AMZDownloadTransfer *xfer;
+	AMZTransportRequest *req;
+	gchar *tmppath;
+	FILE *file;
+	AMZTagWriter *tagger;
+	GByteArray *buf;
+	guint status;
+	gint length;
+	gint bytes;
+	bool opened;
+	bool write_error;
+	bool cancelled;
+	bool done;
+} AMZDownloadAttempt;
+
+struct _AMZDownloadTransfer {
+	AMZDownloadContext ctx;
+	AMZDownloadSession *session;
+	GTimer *timer;
+
+	AMZDownloadAttempt attempts[2];
+	guint nattempts;
+	guint pending;
+	AMZDownloadAttempt *winner;
+
+	gdouble ttfb;
+	gdouble last_check;
+	gint last_bytes;
+
+	guint status;
+	gchar *reason;
+};
+
+static const AMZTransportOps *transports[] = {
+	&amztransport_soup_ops,
+#ifdef HAVE_CURL_MULTI_EPOLL
+	&amztransport_curl_ops,
+#endif
+	NULL
+};
+
+static void
+amzdownload_samples_add(AMZDownloadSamples *samples, gdouble value)
+{
+	samples->values[samples->next] = value;
+	samples->next = (samples->next + 1) % AMZDOWNLOAD_SAMPLES;
+
+	if (samples->count < AMZDOWNLOAD_SAMPLES)
+		samples->count++;
+}
+
+static gint
+amzdownload_compare_double(gconstpointer a, gconstpointer b)
+{
+	gdouble x = *(const gdouble *) a, y = *(const gdouble *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static gdouble
+amzdownload_samples_percentile(const AMZDownloadSamples *samples, gdouble pct)
+{
+	gdouble sorted[AMZDOWNLOAD_SAMPLES];
+
+	memcpy(sorted, samples->values, samples->count * sizeof(gdouble));
+	qsort(sorted, samples->count, sizeof(gdouble), amzdownload_compare_double);
+
+	return sorted[(guint) (pct * (samples->count - 1) + 0.5)];
+}
+
+/*
+ * Every running transfer may have a hedge in flight next to it, so the
+ * transport must allow twice as many connections when hedging is on.
+ */
+static void
+amzdownload_session_update_connections(AMZDownloadSession *session)
+{
+	AMZTransport *t = session->transport;
+
+	if (t->ops->set_max_connections != NULL)
+		t->ops->set_max_connections(t, session->max_transfers * (session->stats.hedging ? 2 : 1));
+}
+
+/*
+ * Creates a session using the named HTTP transport, or the default one if
+ * transport is NULL.  Returns NULL if no such transport was built.
+ */
+AMZDownloadSession *
+amzdownload_session_new_with_transport(const gchar *transport)
+{
+	AMZDownloadSession *session;
+	const AMZTransportOps **ops;
+	AMZTransport *t;
+
+	for (ops = transports; *ops != NULL; ops++)
+	{
+		if (transport == NULL || !strcmp((*ops)->name, transport))
+			break;
+	}
+
+	if (*ops == NULL || (t = (*ops)->create()) == NULL)
+		return NULL;
+
+	session = g_new0(AMZDownloadSession, 1);
+	session->transport = t;
+	session->stats.hedge_ratio = AMZDOWNLOAD_HEDGE_RATIO;
+	session->max_transfers = AMZDOWNLOAD_MAX_TRANSFERS;
+	session->queued = g_queue_new();
+
+	amzdownload_session_update_connections(session);
+
+	return session;
+}
+
+AMZDownloadSession *
+amzdownload_session_new(void)
+{
+	return amzdownload_session_new_with_transport(NULL);
+}
+
+/*
+ * Enables or disables hedged requests on a session.  max_ratio caps the
+ * number of duplicate requests as a fraction of the transfers started so
+ * far; a value <= 0 selects the default, and anything above 0.5 is
+ * clamped to it.
+ */
+void
+amzdownload_session_set_hedging(AMZDownloadSession *session, bool enable, gdouble max_ratio)
+{
+	g_return_if_fail(session != NULL);
+
+	session->stats.hedging = enable;
+	session->stats.hedge_ratio = max_ratio > 0 ? MIN(max_ratio, AMZDOWNLOAD_HEDGE_MAX_RATIO) : AMZDOWNLOAD_HEDGE_RATIO;
+
+	amzdownload_session_update_connections(session);
+}
+
+void
+amzdownload_session_set_max_transfers(AMZDownloadSession *session, guint max_transfers)
+{
+	g_return_if_fail(session != NULL);
+
+	session->max_transfers = MAX(max_transfers, 1);
+
+	amzdownload_session_update_connections(session);
+}
+
+static void
+amzdownload_transfer_free(AMZDownloadTransfer *xfer)
+{
+	guint i;
+
+	for (i = 0; i < xfer->nattempts; i++)
+		g_free(xfer->attempts[i].tmppath);
+
+	if (xfer->timer != NULL)
+		g_timer_destroy(xfer->timer);
+
+	if (xfer->ctx.tag != NULL)
+		amztag_free(xfer->ctx.tag);
+
+	g_free(xfer->ctx.url);
+	g_free(xfer->ctx.path);
+	g_free(xfer->reason);
+	g_slice_free(AMZDownloadTransfer, xfer);
+}
+
+static void
+amzdownload_attempt_cancel(AMZDownloadAttempt *attempt)
+{
+	AMZTransport *transport = attempt->xfer->session->transport;
+
+	if (attempt->done || attempt->cancelled)
+		return;
+
+	attempt->cancelled = true;
+	transport->ops->cancel(transport, attempt->req);
+}
+
+static void
+amzdownload_transfer_set_winner(AMZDownloadTransfer *xfer, AMZDownloadAttempt *attempt)
+{
+	guint i;
+
+	xfer->winner = attempt;
+
+	/* the loser is behind, so there is nothing worth keeping. */
+	for (i = 0; i < xfer->nattempts; i++)
+	{
+		if (&xfer->attempts[i] != attempt && xfer->attempts[i].bytes <= attempt->bytes)
+			amzdownload_attempt_cancel(&xfer->attempts[i]);
+	}
+}
+
+static void
+amzdownload_transfer_set_error(AMZDownloadTransfer *xfer, guint status, const gchar *reason)
+{
+	xfer->status = status;
+	g_free(xfer->reason);
+	xfer->reason = g_strdup(reason);
+}
+
+static void
+amzdownload_attempt_open(AMZDownloadAttempt *attempt)
+{
+	AMZTag *tag = attempt->xfer->ctx.tag;
+
+	attempt->opened = true;
+	attempt->file = g_fopen(attempt->tmppath, "wb");
+
+	if (attempt->file != NULL && tag != NULL)
+	{
+		attempt->tagger = amztag_writer_new(tag);
+		attempt->buf = g_byte_array_new();
+	}
+}
+
+/*
+ * Writes a chunk of the body out, through the tag writer if there is one.
+ */
+static bool
+amzdownload_attempt_write(AMZDownloadAttempt *attempt, const gchar *data, gsize len)
+{
+	GByteArray *buf = attempt->buf;
+
+	if (attempt->file == NULL)
+		return false;
+
+	if (attempt->tagger == NULL)
+		return fwrite(data, 1, len, attempt->file) == len;
+
+	g_byte_array_set_size(buf, 0);
+	if (data != NULL)
+		amztag_writer_feed(attempt->tagger, data, len, buf);
+	else
+		amztag_writer_finish(attempt->tagger, buf);
+
+	return fwrite(buf->data, 1, buf->len, attempt->file) == buf->len;
+}
+
+static void
+amzdownload_attempt_close(AMZDownloadAttempt *attempt)
+{
+	if (attempt->file != NULL && fclose(attempt->file) != 0)
+		attempt->write_error = true;
+
+	attempt->file = NULL;
+
+	if (attempt->tagger != NULL)
+	{
+		amztag_writer_free(attempt->tagger);
+		g_byte_array_free(attempt->buf, TRUE);
+		attempt->tagger = NULL;
+		attempt->buf = NULL;
+	}
+}
+
+static void
+amzdownload_attempt_got_headers(AMZTransportRequest *req, guint status, goffset length, gpointer userdata)
+{
+	AMZDownloadAttempt *attempt = userdata;
+
+	attempt->status = status;
+	attempt->length = length;
+}
+
+static void
+amzdownload_attempt_got_chunk(AMZTransportRequest *req, const gchar *data, gsize len, gpointer userdata)
+{
+	AMZDownloadAttempt *attempt = userdata;
+	AMZDownloadTransfer *xfer = attempt->xfer;
+	AMZDownloadContext *ctx = &xfer->ctx;
+
+	if (attempt->cancelled || !AMZ_TRANSPORT_STATUS_IS_SUCCESSFUL(attempt->status))
+		return;
+
+	if (!attempt->opened)
+		amzdownload_attempt_open(attempt);
+
+	if (!amzdownload_attempt_write(attempt, data, len))
+	{
+		amzdownload_transfer_set_error(xfer, AMZ_TRANSPORT_STATUS_ERROR, g_strerror(errno));
+		attempt->write_error = true;
+		amzdownload_attempt_cancel(attempt);
+		return;
+	}
+
+	attempt->bytes += len;
+
+	if (xfer->winner == NULL)
+	{
+		xfer->ttfb = g_timer_elapsed(xfer->timer, NULL);
+		xfer->last_check = xfer->ttfb;
+		amzdownload_samples_add(&xfer->session->stats.ttfb, xfer->ttfb);
+		amzdownload_transfer_set_winner(xfer, attempt);
+	}
+	else if (xfer->winner != attempt)
+	{
+		/* a hedge issued for a slow body takes over once it overtakes. */
+		if (attempt->bytes <= xfer->winner->bytes)
+			return;
+
+		amzdownload_transfer_set_winner(xfer, attempt);
+	}
+
+	ctx->length = attempt->length;
+	ctx->bytes = attempt->bytes;
+	ctx->progress = ctx->length > 0 ? ((float) ctx->bytes / (float) ctx->length) * 100. : 0;
+
+	if (ctx->progress_notify != NULL)
+		ctx->progress_notify(ctx);
+}
+
+static void
+amzdownload_transfer_complete(AMZDownloadTransfer *xfer)
+{
+	AMZDownloadSession *session = xfer->session;
+	AMZDownloadAttempt *winner = xfer->winner;
+	GError *error = NULL;
+	bool success;
+	gdouble elapsed;
+	guint i;
+
+	success = winner != NULL && !winner->cancelled && AMZ_TRANSPORT_STATUS_IS_SUCCESSFUL(winner->status);
+
+	if (success && winner->opened && g_rename(winner->tmppath, xfer->ctx.path) < 0)
+	{
+		amzdownload_transfer_set_error(xfer, AMZ_TRANSPORT_STATUS_ERROR, g_strerror(errno));
+		success = false;
+	}
+	else if (success && !winner->opened && !g_file_set_contents(xfer->ctx.path, "", 0, &error))
+	{
+		amzdownload_transfer_set_error(xfer, AMZ_TRANSPORT_STATUS_ERROR, error->message);
+		g_error_free(error);
+		success = false;
+	}
+
+	for (i = 0; i < xfer->nattempts; i++)
+	{
+		if (xfer->attempts[i].opened && (!success || &xfer->attempts[i] != winner))
+			g_unlink(xfer->attempts[i].tmppath);
+	}
+
+	elapsed = g_timer_elapsed(xfer->timer, NULL);
+	if (success && elapsed > xfer->ttfb && winner->bytes > 0)
+		amzdownload_samples_add(&session->stats.rate, winner->bytes / (elapsed - xfer->ttfb));
+
+	if (!success && xfer->status != AMZ_TRANSPORT_STATUS_CANCELLED)
+		g_warning("%s: %d %s\n", xfer->ctx.url, xfer->status, xfer->reason ? xfer->reason : "");
+
+	session->active = g_list_remove(session->active, xfer);
+	session->nactive--;
+
+	xfer->ctx.finished = true;
+	xfer->ctx.success = success;
+
+	if (xfer->ctx.finished_notify != NULL)
+		xfer->ctx.finished_notify(&xfer->ctx);
+
+	amzdownload_transfer_free(xfer);
+}
+
+static void
+amzdownload_attempt_finished(AMZTransportRequest *req, guint status, const gchar *reason, gpointer userdata)
+{
+	AMZDownloadAttempt *attempt = userdata;
+	AMZDownloadTransfer *xfer = attempt->xfer;
+	guint i;
+
+	attempt->done = true;
+	attempt->req = NULL;
+	attempt->status = status;
+
+	/* flush whatever the tag writer still holds back before closing. */
+	if (attempt->tagger != NULL && !attempt->cancelled && AMZ_TRANSPORT_STATUS_IS_SUCCESSFUL(status) &&
+	    !amzdownload_attempt_write(attempt, NULL, 0))
+		attempt->write_error = true;
+
+	amzdownload_attempt_close(attempt);
+
+	if (attempt->write_error && !attempt->cancelled)
+		amzdownload_transfer_set_error(xfer, AMZ_TRANSPORT_STATUS_ERROR, g_strerror(errno));
+
+	if (attempt->write_error)
+		attempt->cancelled = true;
+	else if (!attempt->cancelled && AMZ_TRANSPORT_STATUS_IS_SUCCESSFUL(status))
+	{
+		if (xfer->winner != attempt)
+			amzdownload_transfer_set_winner(xfer, attempt);
+
+		for (i = 0; i < xfer->nattempts; i++)
+			amzdownload_attempt_cancel(&xfer->attempts[i]);
+	}
+	else if (!attempt->cancelled)
+		amzdownload_transfer_set_error(xfer, status, reason);
+
+	/* let a surviving duplicate carry on, if there is one. */
+	if (xfer->winner == attempt && (attempt->cancelled || !AMZ_TRANSPORT_STATUS_IS_SUCCESSFUL(status)))
+	{
+		xfer->winner = NULL;
+		for (i = 0; i < xfer->nattempts; i++)
+		{
+			if (!xfer->attempts[i].done && !xfer->attempts[i].cancelled && xfer->attempts[i].bytes > 0)
+				xfer->winner = &xfer->attempts[i];
+		}
+	}
+
+	if (--xfer->pending == 0)
+		amzdownload_transfer_complete(xfer);
+}
+
+static const AMZTransportCallbacks amzdownload_attempt_callbacks = {
+	amzdownload_attempt_got_headers,
+	amzdownload_attempt_got_chunk,
+	amzdownload_attempt_finished,
+};
+
+static void
+amzdownload_transfer_start_attempt(AMZDownloadTransfer *xfer)
+{
+	AMZTransport *transport = xfer->session->transport;
+	AMZDownloadAttempt *attempt = &xfer->attempts[xfer->nattempts];
+
+	attempt->xfer = xfer;
+	attempt->tmppath = g_strdup_printf("%s.part%u", xfer->ctx.path, xfer->nattempts);
+
+	xfer->nattempts++;
+	xfer->pending++;
+
+	attempt->req = transport->ops->start(transport, xfer->ctx.url, &amzdownload_attempt_callbacks, attempt);
+}
+
+static void
+amzdownload_transfer_start(AMZDownloadTransfer *xfer)
+{
+	AMZDownloadSession *session = xfer->session;
+
+	session->active = g_list_prepend(session->active, xfer);
+	session->nactive++;
+
+	/* hedges are not counted, so they do not raise their own cap. */
+	session->stats.transfers++;
+
+	xfer->timer = g_timer_new();
+	amzdownload_transfer_start_attempt(xfer);
+}
+
+static void
+amzdownload_transfer_check(AMZDownloadTransfer *xfer)
+{
+	AMZDownloadStats *stats = &xfer->session->stats;
+	AMZDownloadAttempt *winner = xfer->winner;
+	gdouble elapsed, threshold, rate;
+	bool hedge = false;
+
+	if (xfer->nattempts == G_N_ELEMENTS(xfer->attempts))
+		return;
+
+	elapsed = g_timer_elapsed(xfer->timer, NULL);
+
+	if (winner == NULL)
+	{
+		threshold = AMZDOWNLOAD_DEFAULT_TTFB;
+		if (stats->ttfb.count >= AMZDOWNLOAD_MIN_SAMPLES)
+			threshold = MAX(amzdownload_samples_percentile(&stats->ttfb, 0.95), AMZDOWNLOAD_MIN_TTFB);
+
+		hedge = elapsed > threshold;
+	}
+	else if (elapsed - xfer->last_check >= AMZDOWNLOAD_RATE_WINDOW)
+	{
+		rate = (winner->bytes - xfer->last_bytes) / (elapsed - xfer->last_check);
+		xfer->last_check = elapsed;
+		xfer->last_bytes = winner->bytes;
+
+		/* a transfer that is more than half done is not worth restarting. */
+		if (stats->rate.count >= AMZDOWNLOAD_MIN_SAMPLES &&
+		    (winner->length <= 0 || winner->bytes < winner->length / 2))
+			hedge = rate < amzdownload_samples_percentile(&stats->rate, 0.05);
+	}
+
+	if (!hedge || stats->hedges >= AMZDOWNLOAD_HEDGE_BURST + stats->transfers * stats->hedge_ratio)
+		return;
+
+	stats->hedges++;
+	xfer->ctx.hedged = true;
+	amzdownload_transfer_start_attempt(xfer);
+}
+
+/*
+ * Queues a download of url to path.  The returned context stays valid until
+ * finished_notify has returned.
+ */
+AMZDownloadContext *
+amzdownload_session_queue_url(AMZDownloadSession *session, const gchar *url, const gchar *path,
+			      void (*progress_notify)(AMZDownloadContext *ctx),
+			      void (*finished_notify)(AMZDownloadContext *ctx), gpointer userdata)
+{
+	AMZDownloadTransfer *xfer;
+
+	g_return_val_if_fail(session != NULL, NULL);
+	g_return_val_if_fail(url != NULL, NULL);
+	g_return_val_if_fail(path != NULL, NULL);
+
+	xfer = g_slice_new0(AMZDownloadTransfer);
+	xfer->session = session;
+	xfer->ctx.url = g_strdup(url);
+	xfer->ctx.path = g_strdup(path);
+	xfer->ctx.userdata = userdata;
+	xfer->ctx.progress_notify = progress_notify;
+	xfer->ctx.finished_notify = finished_notify;
+
+	g_queue_push_tail(session->queued, xfer);
+
+	return &xfer->ctx;
+}
+
+static void
+amzdownload_session_start_queued(AMZDownloadSession *session)
+{
+	while (session->nactive < session->max_transfers && !g_queue_is_empty(session->queued))
+		amzdownload_transfer_start(g_queue_pop_head(session->queued));
+}
+
+static void
+amzdownload_session_check_hedges(AMZDownloadSession *session)
+{
+	GList *node, *next;
+
+	if (!session->stats.hedging)
+		return;
+
+	for (node = session->active; node != NULL; node = next)
+	{
+		next = node->next;
+		amzdownload_transfer_check(node->data);
+	}
+}
+
+/*
+ * Starts queued transfers and waits up to timeout_ms for network activity.
+ * Returns true while transfers remain queued or in flight.
+ */
+bool
+amzdownload_session_iterate(AMZDownloadSession *session, guint timeout_ms)
+{
+	g_return_val_if_fail(session != NULL, false);
+
+	amzdownload_session_start_queued(session);
+
+	if (session->stats.hedging && session->nactive > 0)
+		timeout_ms = MIN(timeout_ms, AMZDOWNLOAD_CHECK_INTERVAL);
+
+	session->transport->ops->iterate(session->transport, timeout_ms);
+	amzdownload_session_check_hedges(session);
+
+	return session->nactive > 0 || !g_queue_is_empty(session->queued);
+}
+
+/*
+ * Like amzdownload_session_iterate(), but never waits or runs the GLib main
+ * loop, so it is safe to call from a source dispatched by that loop.  It
+ * starts queued transfers, delivers finished ones and runs hedge checks;
+ * the caller's main loop does the I/O.
+ */
+bool
+amzdownload_session_dispatch(AMZDownloadSession *session)
+{
+	g_return_val_if_fail(session != NULL, false);
+
+	amzdownload_session_start_queued(session);
+	session->transport->ops->dispatch(session->transport);
+	amzdownload_session_check_hedges(session);
+
+	return session->nactive > 0 || !g_queue_is_empty(session->queued);
+}
+
+/*
+ * Cancels every transfer on the session.  Queued ones are reported as
+ * failed straight away; running ones once the transport confirms, with
+ * their partial files removed.
+ */
+void
+amzdownload_session_cancel_all(AMZDownloadSession *session)
+{
+	AMZDownloadTransfer *xfer;
+	GList *node;
+	guint i;
+
+	g_return_if_fail(session != NULL);
+
+	while ((xfer = g_queue_pop_head(session->queued)) != NULL)
+	{
+		xfer->ctx.finished = true;
+		xfer->ctx.success = false;
+
+		if (xfer->ctx.finished_notify != NULL)
+			xfer->ctx.finished_notify(&xfer->ctx);
+
+		amzdownload_transfer_free(xfer);
+	}
+
+	for (node = session->active; node != NULL; node = node->next)
+	{
+		xfer = node->data;
+		amzdownload_transfer_set_error(xfer, AMZ_TRANSPORT_STATUS_CANCELLED, "Cancelled");
+
+		for (i = 0; i < xfer->nattempts; i++)
+			amzdownload_attempt_cancel(&xfer->attempts[i]);
+	}
+}
+
+void
+amzdownload_session_run(AMZDownloadSession *session)
+{
+	g_return_if_fail(session != NULL);
+
+	while (session->nactive > 0 || !g_queue_is_empty(session->queued))
+		amzdownload_session_iterate(session, 1000);
+}
+
+void
+amzdownload_session_free(AMZDownloadSession *session)
+{
+	AMZDownloadTransfer *xfer;
+	GList *node;
+	guint i;
+
+	g_return_if_fail(session != NULL);
+
+	while ((xfer = g_queue_pop_head(session->queued)) != NULL)
+		amzdownload_transfer_free(xfer);
+
+	for (node = session->active; node != NULL; node = node->next)
+	{
+		xfer = node->data;
+		amzdownload_transfer_set_error(xfer, AMZ_TRANSPORT_STATUS_CANCELLED, "Cancelled");
+
+		for (i = 0; i < xfer->nattempts; i++)
+			amzdownload_attempt_cancel(&xfer->attempts[i]);
+	}
+
+	while (session->nactive > 0)
+		session->transport->ops->iterate(session->transport, AMZDOWNLOAD_CHECK_INTERVAL);
+
+	session->transport->ops->destroy(session->transport);
+	g_queue_free(session->queued);
+	g_free(session);
+}
+
+static void
+amzdownload_session_download_finished(AMZDownloadContext *ctx)
+{
+	*(gint *) ctx->userdata = ctx->success;
+}
+
+/*
+ * Downloads url to path, returning once the transfer has finished.  Other
+ * queued transfers make progress in the meantime.
+ */
+bool
+amzdownload_session_download_url(AMZDownloadSession *session, const gchar *url, const gchar *path,
+				 void (*progress_notify)(AMZDownloadContext *ctx))
+{
+	gint result = -1;
+
+	if (amzdownload_session_queue_url(session, url, path, progress_notify,
+					  amzdownload_session_download_finished, &result) == NULL)
+		return false;
+
+	while (result < 0)
+		amzdownload_session_iterate(session, 1000);
+
+	return result > 0;
+}
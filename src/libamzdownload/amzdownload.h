@@ -0,0 +1,129 @@
+/*
+ * libamz: library for accessing, manipulating and decrypting amz files.
+ * amzdownload.h: API declarations for the download library.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+
+#include "libamz.h"
+
+#ifndef __AMZDOWNLOAD_H__
+#define __AMZDOWNLOAD_H__
+
+/* amztag */
+typedef struct _AMZTag AMZTag;
+typedef struct _AMZTagWriter AMZTagWriter;
+
+AMZTag *amztag_new_from_entry(const AMZPlaylistEntry *entry);
+void amztag_free(AMZTag *tag);
+
+AMZTagWriter *amztag_writer_new(const AMZTag *tag);
+void amztag_writer_feed(AMZTagWriter *writer, const gchar *data, gsize len, GByteArray *out);
+void amztag_writer_finish(AMZTagWriter *writer, GByteArray *out);
+void amztag_writer_free(AMZTagWriter *writer);
+
+/* amzdownload */
+typedef struct _AMZDownloadSession AMZDownloadSession;
+typedef struct _AMZDownloadContext AMZDownloadContext;
+
+struct _AMZDownloadContext {
+	gchar *url;
+	gchar *path;
+	gint length;
+	gint bytes;
+	gfloat progress;
+	bool hedged;
+	bool finished;
+	bool success;
+	gpointer userdata;
+
+	/* if set, tags the file while it is written; freed with the context. */
+	AMZTag *tag;
+
+	void (*progress_notify)(AMZDownloadContext *ctx);
+	void (*finished_notify)(AMZDownloadContext *ctx);
+};
+
+AMZDownloadSession *amzdownload_session_new(void);
+AMZDownloadSession *amzdownload_session_new_with_transport(const gchar *transport);
+void amzdownload_session_free(AMZDownloadSession *session);
+void amzdownload_session_set_hedging(AMZDownloadSession *session, bool enable, gdouble max_ratio);
+void amzdownload_session_set_max_transfers(AMZDownloadSession *session, guint max_transfers);
+
+AMZDownloadContext *amzdownload_session_queue_url(AMZDownloadSession *session, const gchar *url, const gchar *path,
+	void (*progress_notify)(AMZDownloadContext *ctx), void (*finished_notify)(AMZDownloadContext *ctx),
+	gpointer userdata);
+bool amzdownload_session_iterate(AMZDownloadSession *session, guint timeout_ms);
+bool amzdownload_session_dispatch(AMZDownloadSession *session);
+void amzdownload_session_cancel_all(AMZDownloadSession *session);
+void amzdownload_session_run(AMZDownloadSession *session);
+
+bool amzdownload_session_download_url(AMZDownloadSession *session, const gchar *url, const gchar *path,
+	void (*progress_notify)(AMZDownloadContext *ctx));
+
+/* amzpipeline */
+typedef struct _AMZPipeline AMZPipeline;
+
+/*
+ * url is NULL for results about a file as a whole: one that could not be
+ * read or parsed (success is false), or the end of a file whose tracks
+ * were all reported before it was fully parsed.
+ */
+typedef struct {
+	const gchar *file;
+	gchar *url;
+	gchar *path;
+	bool success;
+	bool cancelled;
+
+	/* set on the last result reported for file. */
+	bool file_done;
+	guint file_tracks;
+	guint file_failures;
+} AMZPipelineResult;
+
+typedef struct {
+	const gchar *name;
+	guint depth;
+	guint capacity;
+	guint busy;
+	guint64 processed;
+} AMZPipelineStageStats;
+
+typedef gchar *(*AMZPipelinePathFunc)(AMZPlaylistEntry *entry, gpointer userdata);
+typedef void (*AMZPipelineFinishFunc)(const AMZPipelineResult *result, gpointer userdata);
+typedef void (*AMZPipelineProgressFunc)(const AMZDownloadContext *ctx, gpointer userdata);
+
+AMZPipeline *amzpipeline_new(AMZDownloadSession *session, guint depth, AMZPipelinePathFunc path_func,
+	AMZPipelineFinishFunc finish_func, gpointer userdata);
+void amzpipeline_set_tagging(AMZPipeline *pipeline, bool tag);
+void amzpipeline_set_filter(AMZPipeline *pipeline, const AMZPlaylistFilter *filter);
+void amzpipeline_set_progress_func(AMZPipeline *pipeline, AMZPipelineProgressFunc func);
+bool amzpipeline_start(AMZPipeline *pipeline);
+void amzpipeline_push_file(AMZPipeline *pipeline, const gchar *file);
+void amzpipeline_close(AMZPipeline *pipeline);
+void amzpipeline_cancel(AMZPipeline *pipeline);
+bool amzpipeline_is_finished(AMZPipeline *pipeline);
+void amzpipeline_join(AMZPipeline *pipeline);
+guint amzpipeline_get_stats(AMZPipeline *pipeline, AMZPipelineStageStats *stats, guint n);
+void amzpipeline_free(AMZPipeline *pipeline);
+
+#endif
@@ -0,0 +1,717 @@
+/*
+ * libamz: library for accessing, manipulating and decrypting amz files.
+ * amzpipeline.c: bounded, staged read -> decrypt -> parse -> download pipeline.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "amzdownload.h"
+
+/*
+ * Every stage runs on its own thread and takes its input from a bounded
+ * queue.  A stage that produces faster than the next one consumes blocks
+ * on the full queue, so memory use is capped by the queue depths rather
+ * than by the number of files fed in.  The download stage owns the
+ * session; it only takes new tracks while fewer than depth are in flight.
+ */
+typedef enum {
+	AMZPIPELINE_READ,
+	AMZPIPELINE_DECRYPT,
+	AMZPIPELINE_PARSE,
+	AMZPIPELINE_DOWNLOAD,
+	AMZPIPELINE_FINALIZE,
+	AMZPIPELINE_STAGES
+} AMZPipelineStageId;
+
+static const gchar *stage_names[AMZPIPELINE_STAGES] = {
+	"read", "decrypt", "parse", "download", "finalize"
+};
+
+typedef struct {
+	GQueue *items;
+	guint capacity;
+	bool closed;
+	bool busy;
+	guint64 processed;
+	GMutex *lock;
+	GCond *not_empty;
+	GCond *not_full;
+	GThread *thread;
+} AMZPipelineQueue;
+
+/*
+ * Tracks of one file.  The parse stage holds one reference on remaining
+ * until it has handed on every track, and each track holds another until
+ * the finalize stage has reported it.
+ */
+typedef struct {
+	gint remaining;
+	guint tracks;
+	guint failures;
+} AMZPipelineFile;
+
+typedef struct {
+	AMZPipeline *pipeline;
+	AMZPipelineFile *owner;
+	gchar *file;
+	gchar *data;
+	gsize len;
+	AMZPlaylistEntry *entry;
+	AMZPipelineResult result;
+} AMZPipelineItem;
+
+struct _AMZPipeline {
+	AMZDownloadSession *session;
+	AMZPipelineQueue queues[AMZPIPELINE_STAGES];
+	AMZPipelinePathFunc path_func;
+	AMZPipelineFinishFunc finish_func;
+	AMZPipelineProgressFunc progress_func;
+	gpointer userdata;
+	const AMZPlaylistFilter *filter;
+	guint depth;
+	gint inflight;
+	gint finished;
+	gint cancelled;
+	bool tag;
+	bool started;
+};
+
+static void
+amzpipeline_queue_init(AMZPipelineQueue *q, guint capacity)
+{
+	q->items = g_queue_new();
+	q->capacity = MAX(capacity, 1);
+	q->lock = g_mutex_new();
+	q->not_empty = g_cond_new();
+	q->not_full = g_cond_new();
+}
+
+static void
+amzpipeline_queue_destroy(AMZPipelineQueue *q)
+{
+	g_queue_free(q->items);
+	g_mutex_free(q->lock);
+	g_cond_free(q->not_empty);
+	g_cond_free(q->not_full);
+}
+
+static void
+amzpipeline_queue_push(AMZPipelineQueue *q, AMZPipelineItem *item)
+{
+	g_mutex_lock(q->lock);
+
+	while (g_queue_get_length(q->items) >= q->capacity)
+		g_cond_wait(q->not_full, q->lock);
+
+	g_queue_push_tail(q->items, item);
+	g_cond_signal(q->not_empty);
+
+	g_mutex_unlock(q->lock);
+}
+
+/*
+ * Takes the next item, waiting for one if block is set.  Returns NULL once
+ * the queue is closed and drained, or if it is empty and block is not set.
+ * Taking an item marks the stage busy until the next pop.
+ */
+static AMZPipelineItem *
+amzpipeline_queue_pop(AMZPipelineQueue *q, bool block)
+{
+	AMZPipelineItem *item;
+
+	g_mutex_lock(q->lock);
+
+	while (block && g_queue_is_empty(q->items) && !q->closed)
+		g_cond_wait(q->not_empty, q->lock);
+
+	item = g_queue_pop_head(q->items);
+	q->busy = item != NULL;
+	if (item != NULL)
+	{
+		q->processed++;
+		g_cond_signal(q->not_full);
+	}
+
+	g_mutex_unlock(q->lock);
+
+	return item;
+}
+
+static bool
+amzpipeline_queue_drained(AMZPipelineQueue *q)
+{
+	bool ret;
+
+	g_mutex_lock(q->lock);
+	ret = q->closed && g_queue_is_empty(q->items);
+	g_mutex_unlock(q->lock);
+
+	return ret;
+}
+
+static void
+amzpipeline_queue_close(AMZPipelineQueue *q)
+{
+	g_mutex_lock(q->lock);
+	q->closed = true;
+	g_cond_broadcast(q->not_empty);
+	g_mutex_unlock(q->lock);
+}
+
+static void
+amzpipeline_item_free(AMZPipelineItem *item)
+{
+	g_free(item->file);
+	g_free(item->data);
+	if (item->entry != NULL)
+		amzplaylist_entry_free(item->entry);
+	g_free(item->result.url);
+	g_free(item->result.path);
+	g_slice_free(AMZPipelineItem, item);
+}
+
+static AMZPipelineItem *
+amzpipeline_item_new(AMZPipeline *p, const gchar *file)
+{
+	AMZPipelineItem *item;
+
+	item = g_slice_new0(AMZPipelineItem);
+	item->pipeline = p;
+	item->file = g_strdup(file);
+
+	return item;
+}
+
+/*
+ * A file that could not be read, decrypted or parsed goes straight to the
+ * finalize stage as a failed result without a url.
+ */
+static void
+amzpipeline_fail(AMZPipeline *p, AMZPipelineItem *item)
+{
+	g_free(item->data);
+	item->data = NULL;
+
+	item->result.file = item->file;
+	item->result.success = false;
+	item->result.cancelled = g_atomic_int_get(&p->cancelled);
+	amzpipeline_queue_push(&p->queues[AMZPIPELINE_FINALIZE], item);
+}
+
+/*
+ * A track that cannot be downloaded is finalized as a failure right away.
+ */
+static void
+amzpipeline_fail_track(AMZPipeline *p, AMZPipelineItem *item)
+{
+	item->result.file = item->file;
+	item->result.url = g_strdup(item->entry->location != NULL ? item->entry->location : "");
+	item->result.success = false;
+	item->result.cancelled = g_atomic_int_get(&p->cancelled);
+
+	amzplaylist_entry_free(item->entry);
+	item->entry = NULL;
+
+	amzpipeline_queue_push(&p->queues[AMZPIPELINE_FINALIZE], item);
+}
+
+static gpointer
+amzpipeline_read_worker(gpointer userdata)
+{
+	AMZPipeline *p = userdata;
+	AMZPipelineItem *item;
+	GError *error = NULL;
+
+	while ((item = amzpipeline_queue_pop(&p->queues[AMZPIPELINE_READ], true)) != NULL)
+	{
+		if (g_atomic_int_get(&p->cancelled))
+		{
+			amzpipeline_fail(p, item);
+			continue;
+		}
+
+		if (!g_file_get_contents(item->file, &item->data, &item->len, &error))
+		{
+			g_warning("cannot open %s: %s", item->file, error->message);
+			g_error_free(error);
+			error = NULL;
+			amzpipeline_fail(p, item);
+			continue;
+		}
+
+		amzpipeline_queue_push(&p->queues[AMZPIPELINE_DECRYPT], item);
+	}
+
+	amzpipeline_queue_close(&p->queues[AMZPIPELINE_DECRYPT]);
+
+	return NULL;
+}
+
+static gpointer
+amzpipeline_decrypt_worker(gpointer userdata)
+{
+	AMZPipeline *p = userdata;
+	AMZPipelineItem *item;
+	guchar *xspf;
+	gsize len;
+
+	while ((item = amzpipeline_queue_pop(&p->queues[AMZPIPELINE_DECRYPT], true)) != NULL)
+	{
+		if (g_atomic_int_get(&p->cancelled) || !amzfile_decrypt_blob(item->data, item->len, &xspf, &len))
+		{
+			amzpipeline_fail(p, item);
+			continue;
+		}
+
+		g_free(item->data);
+		item->data = (gchar *) xspf;
+		item->len = len;
+
+		amzpipeline_queue_push(&p->queues[AMZPIPELINE_PARSE], item);
+	}
+
+	amzpipeline_queue_close(&p->queues[AMZPIPELINE_PARSE]);
+
+	return NULL;
+}
+
+/*
+ * Called by the parser for each track as soon as it is built, so a file's
+ * tracks never pile up in memory ahead of the download queue.
+ */
+static void
+amzpipeline_parse_entry(AMZPlaylistEntry *entry, gpointer userdata)
+{
+	AMZPipelineItem *item = userdata;
+	AMZPipeline *p = item->pipeline;
+	AMZPipelineItem *track;
+
+	track = amzpipeline_item_new(p, item->file);
+	track->owner = item->owner;
+	track->entry = entry;
+
+	item->owner->tracks++;
+	g_atomic_int_inc(&item->owner->remaining);
+
+	if (g_atomic_int_get(&p->cancelled))
+		amzpipeline_fail_track(p, track);
+	else
+		amzpipeline_queue_push(&p->queues[AMZPIPELINE_DOWNLOAD], track);
+}
+
+static gpointer
+amzpipeline_parse_worker(gpointer userdata)
+{
+	AMZPipeline *p = userdata;
+	AMZPipelineItem *item;
+
+	while ((item = amzpipeline_queue_pop(&p->queues[AMZPIPELINE_PARSE], true)) != NULL)
+	{
+		if (g_atomic_int_get(&p->cancelled))
+		{
+			amzpipeline_fail(p, item);
+			continue;
+		}
+
+		item->owner = g_slice_new0(AMZPipelineFile);
+		item->owner->remaining = 1;
+
+		if (!amzplaylist_parse_foreach((guchar *) item->data, p->filter, amzpipeline_parse_entry, item))
+		{
+			g_warning("failed to parse xspf file embedded in %s", item->file);
+			g_slice_free(AMZPipelineFile, item->owner);
+			item->owner = NULL;
+			amzpipeline_fail(p, item);
+			continue;
+		}
+
+		g_free(item->data);
+		item->data = NULL;
+
+		/* if every track was finalized already, or there were none, report the file here. */
+		if (g_atomic_int_dec_and_test(&item->owner->remaining))
+		{
+			item->result.file = item->file;
+			item->result.success = true;
+			amzpipeline_queue_push(&p->queues[AMZPIPELINE_FINALIZE], item);
+			continue;
+		}
+
+		amzpipeline_item_free(item);
+	}
+
+	amzpipeline_queue_close(&p->queues[AMZPIPELINE_DOWNLOAD]);
+
+	return NULL;
+}
+
+static void
+amzpipeline_download_progress(AMZDownloadContext *ctx)
+{
+	AMZPipelineItem *item = ctx->userdata;
+	AMZPipeline *p = item->pipeline;
+
+	p->progress_func(ctx, p->userdata);
+}
+
+static void
+amzpipeline_download_finished(AMZDownloadContext *ctx)
+{
+	AMZPipelineItem *item = ctx->userdata;
+	AMZPipeline *p = item->pipeline;
+
+	item->result.file = item->file;
+	item->result.url = g_strdup(ctx->url);
+	item->result.path = g_strdup(ctx->path);
+	item->result.success = ctx->success;
+	item->result.cancelled = !ctx->success && g_atomic_int_get(&p->cancelled);
+
+	g_atomic_int_add(&p->inflight, -1);
+	amzpipeline_queue_push(&p->queues[AMZPIPELINE_FINALIZE], item);
+}
+
+static gpointer
+amzpipeline_download_worker(gpointer userdata)
+{
+	AMZPipeline *p = userdata;
+	AMZPipelineQueue *q = &p->queues[AMZPIPELINE_DOWNLOAD];
+	AMZPipelineItem *item;
+	AMZDownloadContext *ctx;
+	gchar *path;
+	bool stopped = false;
+
+	for (;;)
+	{
+		if (!stopped && g_atomic_int_get(&p->cancelled))
+		{
+			amzdownload_session_cancel_all(p->session);
+			stopped = true;
+		}
+
+		/* with nothing in flight there is nothing to drive; just wait for work. */
+		while ((guint) g_atomic_int_get(&p->inflight) < p->depth &&
+		       (item = amzpipeline_queue_pop(q, g_atomic_int_get(&p->inflight) == 0)) != NULL)
+		{
+			if (stopped || item->entry->location == NULL)
+			{
+				amzpipeline_fail_track(p, item);
+				continue;
+			}
+
+			path = p->path_func(item->entry, p->userdata);
+			ctx = amzdownload_session_queue_url(p->session, item->entry->location, path,
+							    p->progress_func != NULL ? amzpipeline_download_progress : NULL,
+							    amzpipeline_download_finished, item);
+			g_free(path);
+
+			if (p->tag)
+				ctx->tag = amztag_new_from_entry(item->entry);
+
+			/* the entry is not needed past this point. */
+			amzplaylist_entry_free(item->entry);
+			item->entry = NULL;
+
+			g_atomic_int_inc(&p->inflight);
+		}
+
+		if (g_atomic_int_get(&p->inflight) == 0 && amzpipeline_queue_drained(q))
+			break;
+
+		amzdownload_session_iterate(p->session, 100);
+	}
+
+	amzpipeline_queue_close(&p->queues[AMZPIPELINE_FINALIZE]);
+
+	return NULL;
+}
+
+static gpointer
+amzpipeline_finalize_worker(gpointer userdata)
+{
+	AMZPipeline *p = userdata;
+	AMZPipelineItem *item;
+	AMZPipelineFile *owner;
+
+	while ((item = amzpipeline_queue_pop(&p->queues[AMZPIPELINE_FINALIZE], true)) != NULL)
+	{
+		owner = item->owner;
+
+		/* a file that could not be read, decrypted or parsed. */
+		if (owner == NULL)
+		{
+			item->result.file_done = true;
+			item->result.file_failures = 1;
+		}
+		else
+		{
+			if (item->result.url != NULL && !item->result.success)
+				owner->failures++;
+
+			/* results without a url come from the parse stage, which already dropped its reference. */
+			if (item->result.url == NULL || g_atomic_int_dec_and_test(&owner->remaining))
+			{
+				item->result.file_done = true;
+				item->result.file_tracks = owner->tracks;
+				item->result.file_failures = owner->failures;
+				g_slice_free(AMZPipelineFile, owner);
+			}
+		}
+
+		if (p->finish_func != NULL)
+			p->finish_func(&item->result, p->userdata);
+
+		amzpipeline_item_free(item);
+	}
+
+	g_atomic_int_set(&p->finished, TRUE);
+
+	return NULL;
+}
+
+static GThreadFunc stage_workers[AMZPIPELINE_STAGES] = {
+	amzpipeline_read_worker,
+	amzpipeline_decrypt_worker,
+	amzpipeline_parse_worker,
+	amzpipeline_download_worker,
+	amzpipeline_finalize_worker,
+};
+
+/*
+ * Creates a pipeline feeding session.  Every queue holds at most depth
+ * items and at most depth tracks are downloading at once.  path_func picks
+ * the destination of each track; finish_func is called from the finalize
+ * stage for every track and for every file that could not be parsed; a
+ * file whose tracks were all reported before the parser finished with it
+ * (or which had none) gets one more result without a url.
+ * From amzpipeline_start() until amzpipeline_join() returns, the session
+ * belongs to the pipeline's download thread.
+ */
+AMZPipeline *
+amzpipeline_new(AMZDownloadSession *session, guint depth, AMZPipelinePathFunc path_func,
+		AMZPipelineFinishFunc finish_func, gpointer userdata)
+{
+	AMZPipeline *p;
+	guint i;
+
+	g_return_val_if_fail(session != NULL, NULL);
+	g_return_val_if_fail(path_func != NULL, NULL);
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	p = g_new0(AMZPipeline, 1);
+	p->session = session;
+	p->depth = MAX(depth, 1);
+	p->path_func = path_func;
+	p->finish_func = finish_func;
+	p->userdata = userdata;
+
+	for (i = 0; i < AMZPIPELINE_STAGES; i++)
+		amzpipeline_queue_init(&p->queues[i], p->depth);
+
+	return p;
+}
+
+void
+amzpipeline_set_tagging(AMZPipeline *p, bool tag)
+{
+	g_return_if_fail(p != NULL);
+	g_return_if_fail(!p->started);
+
+	p->tag = tag;
+}
+
+/*
+ * Only tracks matching filter are downloaded; the rest are dropped by the
+ * parser before any job is made for them.  The filter is borrowed and must
+ * outlive the pipeline.
+ */
+void
+amzpipeline_set_filter(AMZPipeline *p, const AMZPlaylistFilter *filter)
+{
+	g_return_if_fail(p != NULL);
+	g_return_if_fail(!p->started);
+
+	p->filter = filter;
+}
+
+/*
+ * Calls func from the download stage whenever a track makes progress.
+ * ctx->userdata belongs to the pipeline.
+ */
+void
+amzpipeline_set_progress_func(AMZPipeline *p, AMZPipelineProgressFunc func)
+{
+	g_return_if_fail(p != NULL);
+	g_return_if_fail(!p->started);
+
+	p->progress_func = func;
+}
+
+bool
+amzpipeline_start(AMZPipeline *p)
+{
+	GError *error = NULL;
+	guint i;
+
+	g_return_val_if_fail(p != NULL, false);
+	g_return_val_if_fail(!p->started, false);
+
+	for (i = 0; i < AMZPIPELINE_STAGES; i++)
+	{
+		p->queues[i].thread = g_thread_create(stage_workers[i], p, TRUE, &error);
+		if (p->queues[i].thread == NULL)
+		{
+			g_warning("cannot start %s stage: %s", stage_names[i], error->message);
+			g_error_free(error);
+
+			/* unwind the stages already running. */
+			amzpipeline_queue_close(&p->queues[AMZPIPELINE_READ]);
+			while (i-- > 0)
+				g_thread_join(p->queues[i].thread);
+
+			return false;
+		}
+	}
+
+	p->started = true;
+
+	return true;
+}
+
+/*
+ * Feeds an .amz file into the pipeline, blocking while the read queue is
+ * full.
+ */
+void
+amzpipeline_push_file(AMZPipeline *p, const gchar *file)
+{
+	g_return_if_fail(p != NULL);
+	g_return_if_fail(file != NULL);
+
+	amzpipeline_queue_push(&p->queues[AMZPIPELINE_READ], amzpipeline_item_new(p, file));
+}
+
+/*
+ * Signals that no more files will be pushed.
+ */
+void
+amzpipeline_close(AMZPipeline *p)
+{
+	g_return_if_fail(p != NULL);
+
+	amzpipeline_queue_close(&p->queues[AMZPIPELINE_READ]);
+}
+
+/*
+ * Stops the pipeline early: files and tracks not yet downloading are
+ * finalized as cancelled, and running transfers are cancelled with their
+ * partial files removed.  Results still arrive for everything pushed, and
+ * amzpipeline_close() and amzpipeline_join() are still needed.  This only
+ * sets a flag, so it may be called from a signal handler.
+ */
+void
+amzpipeline_cancel(AMZPipeline *p)
+{
+	g_atomic_int_set(&p->cancelled, TRUE);
+}
+
+/*
+ * Returns true once the last result has been finalized.
+ */
+bool
+amzpipeline_is_finished(AMZPipeline *p)
+{
+	g_return_val_if_fail(p != NULL, true);
+
+	return g_atomic_int_get(&p->finished);
+}
+
+/*
+ * Waits for every stage to drain.  amzpipeline_close() must have been
+ * called first.
+ */
+void
+amzpipeline_join(AMZPipeline *p)
+{
+	guint i;
+
+	g_return_if_fail(p != NULL);
+
+	if (!p->started)
+		return;
+
+	for (i = 0; i < AMZPIPELINE_STAGES; i++)
+		g_thread_join(p->queues[i].thread);
+
+	p->started = false;
+}
+
+/*
+ * Fills in the occupancy of up to n stages, in pipeline order, and returns
+ * the number of stages.
+ */
+guint
+amzpipeline_get_stats(AMZPipeline *p, AMZPipelineStageStats *stats, guint n)
+{
+	AMZPipelineQueue *q;
+	guint i;
+
+	g_return_val_if_fail(p != NULL, 0);
+
+	for (i = 0; i < MIN(n, AMZPIPELINE_STAGES); i++)
+	{
+		q = &p->queues[i];
+
+		g_mutex_lock(q->lock);
+		stats[i].name = stage_names[i];
+		stats[i].depth = g_queue_get_length(q->items);
+		stats[i].capacity = q->capacity;
+		stats[i].busy = q->busy;
+		stats[i].processed = q->processed;
+		g_mutex_unlock(q->lock);
+	}
+
+	/* the download stage is busy with everything it has in flight. */
+	if (n > AMZPIPELINE_DOWNLOAD)
+		stats[AMZPIPELINE_DOWNLOAD].busy = g_atomic_int_get(&p->inflight);
+
+	return AMZPIPELINE_STAGES;
+}
+
+void
+amzpipeline_free(AMZPipeline *p)
+{
+	guint i;
+
+	g_return_if_fail(p != NULL);
+	g_return_if_fail(!p->started);
+
+	for (i = 0; i < AMZPIPELINE_STAGES; i++)
+	{
+		g_queue_foreach(p->queues[i].items, (GFunc) amzpipeline_item_free, NULL);
+		amzpipeline_queue_destroy(&p->queues[i]);
+	}
+
+	g_free(p);
+}
@@ -0,0 +1,595 @@
+/*
+ * libamz: library for accessing, manipulating and decrypting amz files.
+ * amztag.c: inline ID3v2 and Vorbis comment tagging of downloaded streams.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "amzdownload.h"
+
+/*
+ * The tag writer sits between the transport and the output file.  It sniffs
+ * the first bytes of the body and then:
+ *
+ *   - for MPEG audio, emits an ID3v2.4 tag in front of the stream.  An
+ *     existing ID3v2.3 or v2.4 tag is merged and keeps its version: our
+ *     frames replace its TIT2, TPE1, TALB and TRCK, everything else that
+ *     may be carried over is kept;
+ *   - for FLAC, passes the metadata blocks through and appends a Vorbis
+ *     comment block after them, merged with any existing one in the same
+ *     way;
+ *   - for anything else, passes the stream through untouched.
+ *
+ * Only headers and existing tags are ever buffered, so the tagged file is
+ * still produced in one sequential write.
+ */
+#define AMZTAG_MAX_MERGE	(16 * 1024 * 1024)
+
+#define FLAC_BLOCK_LAST		0x80
+#define FLAC_BLOCK_COMMENT	4
+
+typedef enum {
+	AMZTAG_STATE_SNIFF,
+	AMZTAG_STATE_ID3_TAG,
+	AMZTAG_STATE_ID3_SKIP,
+	AMZTAG_STATE_FLAC_HEADER,
+	AMZTAG_STATE_FLAC_BLOCK,
+	AMZTAG_STATE_FLAC_COMMENT,
+	AMZTAG_STATE_FLAC_SKIP,
+	AMZTAG_STATE_BODY
+} AMZTagState;
+
+struct _AMZTag {
+	gchar *title;
+	gchar *creator;
+	gchar *album;
+	gint tracknum;
+};
+
+struct _AMZTagWriter {
+	const AMZTag *tag;
+	AMZTagState state;
+	GByteArray *pending;
+	gsize need;
+	bool last;
+	GPtrArray *comments;
+};
+
+static const gchar *id3_replaced[] = { "TIT2", "TPE1", "TALB", "TRCK", NULL };
+static const gchar *vorbis_replaced[] = { "TITLE", "ARTIST", "ALBUM", "TRACKNUMBER", NULL };
+
+AMZTag *
+amztag_new_from_entry(const AMZPlaylistEntry *entry)
+{
+	AMZTag *tag;
+
+	g_return_val_if_fail(entry != NULL, NULL);
+
+	tag = g_slice_new0(AMZTag);
+	tag->title = g_strdup(entry->title);
+	tag->creator = g_strdup(entry->creator);
+	tag->album = g_strdup(entry->album);
+	tag->tracknum = entry->tracknum;
+
+	return tag;
+}
+
+void
+amztag_free(AMZTag *tag)
+{
+	g_return_if_fail(tag != NULL);
+
+	g_free(tag->title);
+	g_free(tag->creator);
+	g_free(tag->album);
+	g_slice_free(AMZTag, tag);
+}
+
+static guint32
+get_be32(const guint8 *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static guint32
+get_le32(const guint8 *p)
+{
+	return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static guint32
+get_syncsafe(const guint8 *p)
+{
+	return ((p[0] & 0x7f) << 21) | ((p[1] & 0x7f) << 14) | ((p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+static void
+put_be24(GByteArray *out, guint32 v)
+{
+	guint8 b[3] = { v >> 16, v >> 8, v };
+
+	g_byte_array_append(out, b, sizeof b);
+}
+
+static void
+put_be32(GByteArray *out, guint32 v)
+{
+	guint8 b[4] = { v >> 24, v >> 16, v >> 8, v };
+
+	g_byte_array_append(out, b, sizeof b);
+}
+
+static void
+put_le32(GByteArray *out, guint32 v)
+{
+	guint8 b[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+	g_byte_array_append(out, b, sizeof b);
+}
+
+static void
+put_syncsafe(GByteArray *out, guint32 v)
+{
+	guint8 b[4] = { (v >> 21) & 0x7f, (v >> 14) & 0x7f, (v >> 7) & 0x7f, v & 0x7f };
+
+	g_byte_array_append(out, b, sizeof b);
+}
+
+static bool
+in_list(const gchar **list, const gchar *name, gsize len)
+{
+	for (; *list != NULL; list++)
+	{
+		if (strlen(*list) == len && !g_ascii_strncasecmp(*list, name, len))
+			return true;
+	}
+
+	return false;
+}
+
+/* ID3v2.3 frame sizes are plain 32-bit integers; v2.4 made them syncsafe. */
+static void
+id3_put_frame(GByteArray *frames, guint version, const gchar *id, const guint8 *data, gsize len)
+{
+	static const guint8 flags[2] = { 0, 0 };
+
+	g_byte_array_append(frames, (const guint8 *) id, 4);
+	if (version == 3)
+		put_be32(frames, len);
+	else
+		put_syncsafe(frames, len);
+	g_byte_array_append(frames, flags, sizeof flags);
+	g_byte_array_append(frames, data, len);
+}
+
+/*
+ * ID3v2.3 has no UTF-8 text encoding, so text goes out as UTF-16 with a
+ * byte order mark there.
+ */
+static void
+id3_put_text_frame(GByteArray *frames, guint version, const gchar *id, const gchar *text)
+{
+	GByteArray *data;
+	gunichar2 *utf16;
+	glong i, len;
+	guint8 b[2];
+	static const guint8 utf8 = 3, utf16_bom[3] = { 1, 0xff, 0xfe };
+
+	if (text == NULL || *text == '\0')
+		return;
+
+	data = g_byte_array_new();
+
+	if (version == 3)
+	{
+		if ((utf16 = g_utf8_to_utf16(text, -1, NULL, &len, NULL)) == NULL)
+		{
+			g_byte_array_free(data, TRUE);
+			return;
+		}
+
+		g_byte_array_append(data, utf16_bom, sizeof utf16_bom);
+		for (i = 0; i < len; i++)
+		{
+			b[0] = utf16[i];
+			b[1] = utf16[i] >> 8;
+			g_byte_array_append(data, b, sizeof b);
+		}
+
+		g_free(utf16);
+	}
+	else
+	{
+		g_byte_array_append(data, &utf8, 1);
+		g_byte_array_append(data, (const guint8 *) text, strlen(text));
+	}
+
+	id3_put_frame(frames, version, id, data->data, data->len);
+	g_byte_array_free(data, TRUE);
+}
+
+/*
+ * Copies the frames of an existing ID3v2.3 or v2.4 tag which we do not
+ * replace.  Frames that are compressed, encrypted or otherwise transformed,
+ * or that ask to be dropped when the tag is altered, are not carried over.
+ */
+static void
+id3_merge_frames(GByteArray *frames, const guint8 *tag, gsize len)
+{
+	guint version = tag[3];
+	gsize pos = 10, end = 10 + get_syncsafe(tag + 6);
+	guint32 size;
+	guint16 flags;
+
+	end = MIN(end, len);
+
+	while (pos + 10 <= end && tag[pos] != 0)
+	{
+		size = version == 4 ? get_syncsafe(tag + pos + 4) : get_be32(tag + pos + 4);
+		flags = (tag[pos + 8] << 8) | tag[pos + 9];
+
+		if (size > end - pos - 10)
+			break;
+
+		if (!in_list(id3_replaced, (const gchar *) tag + pos, 4) && !(flags & 0x00ff) &&
+		    !(flags & (version == 4 ? 0x4000 : 0x8000)))
+			id3_put_frame(frames, version, (const gchar *) tag + pos, tag + pos + 10, size);
+
+		pos += 10 + size;
+	}
+}
+
+/*
+ * Writes our tag, merged with old if there is one.  The merged frames are
+ * copied verbatim, so the tag keeps the version they were written for.
+ */
+static void
+id3_write_tag(const AMZTag *tag, const guint8 *old, gsize oldlen, GByteArray *out)
+{
+	guint8 header[6] = { 'I', 'D', '3', 4, 0, 0 };
+	GByteArray *frames;
+	gchar *track;
+	guint version = old != NULL ? old[3] : 4;
+
+	header[3] = version;
+	frames = g_byte_array_new();
+
+	id3_put_text_frame(frames, version, "TIT2", tag->title);
+	id3_put_text_frame(frames, version, "TPE1", tag->creator);
+	id3_put_text_frame(frames, version, "TALB", tag->album);
+
+	if (tag->tracknum > 0)
+	{
+		track = g_strdup_printf("%d", tag->tracknum);
+		id3_put_text_frame(frames, version, "TRCK", track);
+		g_free(track);
+	}
+
+	if (old != NULL)
+		id3_merge_frames(frames, old, oldlen);
+
+	g_byte_array_append(out, header, sizeof header);
+	put_syncsafe(out, frames->len);
+	g_byte_array_append(out, frames->data, frames->len);
+
+	g_byte_array_free(frames, TRUE);
+}
+
+static void
+vorbis_merge_comments(GPtrArray *comments, const guint8 *data, gsize len)
+{
+	gsize pos;
+	guint32 count, size;
+	const gchar *eq;
+
+	if (len < 4 || (pos = 4 + (gsize) get_le32(data)) + 4 > len)
+		return;
+
+	count = get_le32(data + pos);
+	pos += 4;
+
+	while (count-- > 0 && pos + 4 <= len)
+	{
+		size = get_le32(data + pos);
+		pos += 4;
+
+		if (size > len - pos)
+			break;
+
+		eq = memchr(data + pos, '=', size);
+		if (eq != NULL && !in_list(vorbis_replaced, (const gchar *) data + pos, eq - ((const gchar *) data + pos)))
+			g_ptr_array_add(comments, g_strndup((const gchar *) data + pos, size));
+
+		pos += size;
+	}
+}
+
+static void
+vorbis_put_comment(GByteArray *block, const gchar *name, const gchar *value, guint *count)
+{
+	gchar *comment;
+
+	if (value == NULL || *value == '\0')
+		return;
+
+	comment = g_strconcat(name, "=", value, NULL);
+	put_le32(block, strlen(comment));
+	g_byte_array_append(block, (const guint8 *) comment, strlen(comment));
+	g_free(comment);
+
+	(*count)++;
+}
+
+static void
+flac_write_comment_block(AMZTagWriter *w, GByteArray *out)
+{
+	static const gchar vendor[] = "libamz";
+	const AMZTag *tag = w->tag;
+	GByteArray *block;
+	guint count = 0, i;
+	gchar *track = NULL;
+	guint8 type = FLAC_BLOCK_LAST | FLAC_BLOCK_COMMENT;
+
+	block = g_byte_array_new();
+	put_le32(block, strlen(vendor));
+	g_byte_array_append(block, (const guint8 *) vendor, strlen(vendor));
+	put_le32(block, 0);
+
+	vorbis_put_comment(block, "TITLE", tag->title, &count);
+	vorbis_put_comment(block, "ARTIST", tag->creator, &count);
+	vorbis_put_comment(block, "ALBUM", tag->album, &count);
+
+	if (tag->tracknum > 0)
+		track = g_strdup_printf("%d", tag->tracknum);
+	vorbis_put_comment(block, "TRACKNUMBER", track, &count);
+	g_free(track);
+
+	for (i = 0; i < w->comments->len; i++)
+	{
+		const gchar *comment = g_ptr_array_index(w->comments, i);
+
+		put_le32(block, strlen(comment));
+		g_byte_array_append(block, (const guint8 *) comment, strlen(comment));
+		count++;
+	}
+
+	/* patch in the comment count now that it is known. */
+	block->data[4 + strlen(vendor)] = count;
+	block->data[5 + strlen(vendor)] = count >> 8;
+	block->data[6 + strlen(vendor)] = count >> 16;
+	block->data[7 + strlen(vendor)] = count >> 24;
+
+	g_byte_array_append(out, &type, 1);
+	put_be24(out, block->len);
+	g_byte_array_append(out, block->data, block->len);
+
+	g_byte_array_free(block, TRUE);
+}
+
+AMZTagWriter *
+amztag_writer_new(const AMZTag *tag)
+{
+	AMZTagWriter *w;
+
+	g_return_val_if_fail(tag != NULL, NULL);
+
+	w = g_slice_new0(AMZTagWriter);
+	w->tag = tag;
+	w->state = AMZTAG_STATE_SNIFF;
+	w->pending = g_byte_array_new();
+	w->need = 4;
+	w->comments = g_ptr_array_new();
+
+	return w;
+}
+
+void
+amztag_writer_free(AMZTagWriter *w)
+{
+	g_return_if_fail(w != NULL);
+
+	g_ptr_array_foreach(w->comments, (GFunc) g_free, NULL);
+	g_ptr_array_free(w->comments, TRUE);
+	g_byte_array_free(w->pending, TRUE);
+	g_slice_free(AMZTagWriter, w);
+}
+
+static bool
+amztag_writer_counting(AMZTagWriter *w)
+{
+	return w->state == AMZTAG_STATE_ID3_SKIP || w->state == AMZTAG_STATE_FLAC_BLOCK ||
+	       w->state == AMZTAG_STATE_FLAC_SKIP;
+}
+
+static void amztag_writer_advance(AMZTagWriter *w, GByteArray *out);
+
+static void
+amztag_writer_enter(AMZTagWriter *w, AMZTagState state, gsize need, GByteArray *out)
+{
+	w->state = state;
+	w->need = need;
+	g_byte_array_set_size(w->pending, 0);
+
+	if (state != AMZTAG_STATE_BODY && w->need == 0)
+		amztag_writer_advance(w, out);
+}
+
+static void
+amztag_writer_flac_block_done(AMZTagWriter *w, GByteArray *out)
+{
+	if (!w->last)
+	{
+		amztag_writer_enter(w, AMZTAG_STATE_FLAC_HEADER, 4, out);
+		return;
+	}
+
+	flac_write_comment_block(w, out);
+	amztag_writer_enter(w, AMZTAG_STATE_BODY, 0, out);
+}
+
+static void
+amztag_writer_sniff(AMZTagWriter *w, GByteArray *out)
+{
+	const guint8 *p = w->pending->data;
+	gsize total;
+
+	if (!memcmp(p, "ID3", 3))
+	{
+		if (w->need < 10)
+		{
+			w->need = 10;
+			return;
+		}
+
+		total = 10 + get_syncsafe(p + 6) + (p[3] == 4 && (p[5] & 0x10) ? 10 : 0);
+
+		/* unsynchronised tags, extended headers and ID3v2.2 are replaced outright. */
+		if ((p[3] == 3 || p[3] == 4) && !(p[5] & 0xc0) && total <= AMZTAG_MAX_MERGE)
+		{
+			w->state = AMZTAG_STATE_ID3_TAG;
+			w->need = total;
+			return;
+		}
+
+		id3_write_tag(w->tag, NULL, 0, out);
+		amztag_writer_enter(w, AMZTAG_STATE_ID3_SKIP, total - 10, out);
+	}
+	else if (!memcmp(p, "fLaC", 4))
+	{
+		g_byte_array_append(out, p, 4);
+		amztag_writer_enter(w, AMZTAG_STATE_FLAC_HEADER, 4, out);
+	}
+	else
+	{
+		/* MPEG audio frame sync: an untagged mp3. */
+		if (p[0] == 0xff && (p[1] & 0xe0) == 0xe0)
+			id3_write_tag(w->tag, NULL, 0, out);
+
+		g_byte_array_append(out, p, w->pending->len);
+		amztag_writer_enter(w, AMZTAG_STATE_BODY, 0, out);
+	}
+}
+
+static void
+amztag_writer_advance(AMZTagWriter *w, GByteArray *out)
+{
+	const guint8 *p = w->pending->data;
+	guint8 type;
+	gsize len;
+
+	switch (w->state)
+	{
+	case AMZTAG_STATE_SNIFF:
+		amztag_writer_sniff(w, out);
+		break;
+	case AMZTAG_STATE_ID3_TAG:
+		id3_write_tag(w->tag, p, w->pending->len, out);
+		amztag_writer_enter(w, AMZTAG_STATE_BODY, 0, out);
+		break;
+	case AMZTAG_STATE_ID3_SKIP:
+		amztag_writer_enter(w, AMZTAG_STATE_BODY, 0, out);
+		break;
+	case AMZTAG_STATE_FLAC_HEADER:
+		w->last = (p[0] & FLAC_BLOCK_LAST) != 0;
+		len = (p[1] << 16) | (p[2] << 8) | p[3];
+
+		if ((p[0] & ~FLAC_BLOCK_LAST) == FLAC_BLOCK_COMMENT)
+		{
+			amztag_writer_enter(w, len <= AMZTAG_MAX_MERGE ? AMZTAG_STATE_FLAC_COMMENT : AMZTAG_STATE_FLAC_SKIP, len, out);
+			break;
+		}
+
+		/* our comment block goes last, so nothing else may claim to be. */
+		type = p[0] & ~FLAC_BLOCK_LAST;
+		g_byte_array_append(out, &type, 1);
+		g_byte_array_append(out, p + 1, 3);
+		amztag_writer_enter(w, AMZTAG_STATE_FLAC_BLOCK, len, out);
+		break;
+	case AMZTAG_STATE_FLAC_COMMENT:
+		vorbis_merge_comments(w->comments, p, w->pending->len);
+		amztag_writer_flac_block_done(w, out);
+		break;
+	case AMZTAG_STATE_FLAC_BLOCK:
+	case AMZTAG_STATE_FLAC_SKIP:
+		amztag_writer_flac_block_done(w, out);
+		break;
+	case AMZTAG_STATE_BODY:
+		break;
+	}
+}
+
+/*
+ * Feeds len bytes of the downloaded body through the writer, appending
+ * whatever is ready to be written to out.
+ */
+void
+amztag_writer_feed(AMZTagWriter *w, const gchar *data, gsize len, GByteArray *out)
+{
+	gsize n;
+
+	g_return_if_fail(w != NULL);
+
+	while (len > 0)
+	{
+		if (w->state == AMZTAG_STATE_BODY)
+		{
+			g_byte_array_append(out, (const guint8 *) data, len);
+			return;
+		}
+
+		if (amztag_writer_counting(w))
+		{
+			n = MIN(len, w->need);
+			if (w->state == AMZTAG_STATE_FLAC_BLOCK)
+				g_byte_array_append(out, (const guint8 *) data, n);
+
+			w->need -= n;
+		}
+		else
+		{
+			n = MIN(len, w->need - w->pending->len);
+			g_byte_array_append(w->pending, (const guint8 *) data, n);
+		}
+
+		data += n;
+		len -= n;
+
+		if (amztag_writer_counting(w) ? w->need == 0 : w->pending->len == w->need)
+			amztag_writer_advance(w, out);
+	}
+}
+
+/*
+ * Flushes anything still held back at the end of the stream, which only
+ * happens for bodies too short or too broken to tag.
+ */
+void
+amztag_writer_finish(AMZTagWriter *w, GByteArray *out)
+{
+	g_return_if_fail(w != NULL);
+
+	if (!amztag_writer_counting(w))
+		g_byte_array_append(out, w->pending->data, w->pending->len);
+
+	amztag_writer_enter(w, AMZTAG_STATE_BODY, 0, out);
+}
@@ -0,0 +1,77 @@
+/*
+ * libamz: library for accessing, manipulating and decrypting amz files.
+ * amztransport.h: HTTP transport interface used by the download engine.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+
+#ifndef __AMZTRANSPORT_H__
+#define __AMZTRANSPORT_H__
+
+/*
+ * Status codes below 100 are not HTTP responses.  They match libsoup's
+ * SOUP_STATUS_CANCELLED and transport error range.
+ */
+#define AMZ_TRANSPORT_STATUS_CANCELLED	1
+#define AMZ_TRANSPORT_STATUS_ERROR	2
+
+#define AMZ_TRANSPORT_STATUS_IS_SUCCESSFUL(status)	((status) >= 200 && (status) < 300)
+
+typedef struct _AMZTransport AMZTransport;
+typedef struct _AMZTransportRequest AMZTransportRequest;
+
+typedef struct {
+	void (*got_headers)(AMZTransportRequest *req, guint status, goffset length, gpointer userdata);
+	void (*got_chunk)(AMZTransportRequest *req, const gchar *data, gsize len, gpointer userdata);
+	void (*finished)(AMZTransportRequest *req, guint status, const gchar *reason, gpointer userdata);
+} AMZTransportCallbacks;
+
+/*
+ * A backend hands out requests from start(); each one is reported through
+ * finished() exactly once, also when it was cancelled, and is invalid after
+ * that.  finished() is only ever called from within iterate() or dispatch(),
+ * so the engine may start and cancel requests from any callback.  iterate()
+ * blocks for at most timeout_ms.  dispatch() only reports what has already
+ * happened: it neither waits nor runs the GLib main loop, for callers whose
+ * own main loop already drives the backend.  set_max_connections() tells a
+ * backend with its own connection limit how many requests the engine may
+ * have running at once; backends without such a limit leave it NULL.
+ */
+typedef struct {
+	const gchar *name;
+	AMZTransport *(*create)(void);
+	void (*destroy)(AMZTransport *transport);
+	AMZTransportRequest *(*start)(AMZTransport *transport, const gchar *url,
+				      const AMZTransportCallbacks *cb, gpointer userdata);
+	void (*cancel)(AMZTransport *transport, AMZTransportRequest *req);
+	void (*iterate)(AMZTransport *transport, guint timeout_ms);
+	void (*dispatch)(AMZTransport *transport);
+	void (*set_max_connections)(AMZTransport *transport, guint max_connections);
+} AMZTransportOps;
+
+struct _AMZTransport {
+	const AMZTransportOps *ops;
+};
+
+extern const AMZTransportOps amztransport_soup_ops;
+extern const AMZTransportOps amztransport_curl_ops;
+
+#endif
@@ -0,0 +1,375 @@
+/*
+ * libamz: library for accessing, manipulating and decrypting amz files.
+ * amztransport_curl.c: libcurl multi transport driven by an epoll loop.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
+/* without libcurl or epoll this file builds to nothing. */
+#ifdef HAVE_CURL_MULTI_EPOLL
+
+#include <glib.h>
+#include <curl/curl.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "amztransport.h"
+
+/*
+ * All transfers share one curl multi handle.  curl tells us which sockets
+ * it wants watched and when it next needs a timeout; we keep those in a
+ * single epoll set, so hundreds of transfers cost one epoll_wait() per
+ * iteration on a single thread.
+ */
+#define AMZTRANSPORT_CURL_EVENTS	64
+
+typedef struct {
+	AMZTransport parent;
+	CURLM *multi;
+	gint epfd;
+	gint64 deadline;
+	GQueue *cancelled;
+} AMZTransportCurl;
+
+struct _AMZTransportRequest {
+	AMZTransportCurl *transport;
+	CURL *easy;
+	const AMZTransportCallbacks *cb;
+	gpointer userdata;
+	bool headers_done;
+	bool cancelled;
+	gchar *reason;
+	gchar errbuf[CURL_ERROR_SIZE];
+};
+
+static gint64
+amztransport_curl_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (gint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+amztransport_curl_socket(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
+{
+	AMZTransportCurl *t = userp;
+	struct epoll_event ev;
+
+	if (what == CURL_POLL_REMOVE)
+	{
+		epoll_ctl(t->epfd, EPOLL_CTL_DEL, s, NULL);
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof ev);
+	ev.data.fd = s;
+	if (what & CURL_POLL_IN)
+		ev.events |= EPOLLIN;
+	if (what & CURL_POLL_OUT)
+		ev.events |= EPOLLOUT;
+
+	if (epoll_ctl(t->epfd, EPOLL_CTL_MOD, s, &ev) < 0 && errno == ENOENT)
+		epoll_ctl(t->epfd, EPOLL_CTL_ADD, s, &ev);
+
+	return 0;
+}
+
+static int
+amztransport_curl_timer(CURLM *multi, long timeout_ms, void *userp)
+{
+	AMZTransportCurl *t = userp;
+
+	t->deadline = timeout_ms < 0 ? -1 : amztransport_curl_now() + timeout_ms;
+
+	return 0;
+}
+
+static AMZTransport *
+amztransport_curl_create(void)
+{
+	AMZTransportCurl *t;
+
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+	t = g_new0(AMZTransportCurl, 1);
+	t->parent.ops = &amztransport_curl_ops;
+	t->deadline = -1;
+	t->cancelled = g_queue_new();
+
+	if ((t->epfd = epoll_create(AMZTRANSPORT_CURL_EVENTS)) < 0)
+	{
+		g_warning("epoll_create: %s", g_strerror(errno));
+		g_queue_free(t->cancelled);
+		g_free(t);
+		return NULL;
+	}
+
+	t->multi = curl_multi_init();
+	curl_multi_setopt(t->multi, CURLMOPT_SOCKETFUNCTION, amztransport_curl_socket);
+	curl_multi_setopt(t->multi, CURLMOPT_SOCKETDATA, t);
+	curl_multi_setopt(t->multi, CURLMOPT_TIMERFUNCTION, amztransport_curl_timer);
+	curl_multi_setopt(t->multi, CURLMOPT_TIMERDATA, t);
+
+	return &t->parent;
+}
+
+static void
+amztransport_curl_request_free(AMZTransportRequest *req)
+{
+	curl_multi_remove_handle(req->transport->multi, req->easy);
+	curl_easy_cleanup(req->easy);
+	g_free(req->reason);
+	g_slice_free(AMZTransportRequest, req);
+}
+
+static void
+amztransport_curl_destroy(AMZTransport *transport)
+{
+	AMZTransportCurl *t = (AMZTransportCurl *) transport;
+
+	/* requests still running belong to the engine, which cancels them first. */
+	g_queue_free(t->cancelled);
+	curl_multi_cleanup(t->multi);
+	close(t->epfd);
+	g_free(t);
+}
+
+static void
+amztransport_curl_got_headers(AMZTransportRequest *req)
+{
+	long status = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_off_t length = -1;
+#else
+	double length = -1;
+#endif
+
+	req->headers_done = true;
+
+	curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &status);
+
+	/* the double variant is deprecated since 7.55.0. */
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_easy_getinfo(req->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+#else
+	curl_easy_getinfo(req->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length);
+#endif
+
+	req->cb->got_headers(req, status, (goffset) length, req->userdata);
+}
+
+static size_t
+amztransport_curl_header(char *data, size_t size, size_t nmemb, void *userp)
+{
+	AMZTransportRequest *req = userp;
+	gsize len = size * nmemb;
+	gchar *line, **fields;
+
+	/* remember the reason phrase of the last status line, e.g. after redirects. */
+	if (len > 5 && !strncmp(data, "HTTP/", 5))
+	{
+		line = g_strstrip(g_strndup(data, len));
+		fields = g_strsplit(line, " ", 3);
+
+		g_free(req->reason);
+		req->reason = g_strdup(g_strv_length(fields) == 3 ? fields[2] : "");
+
+		g_strfreev(fields);
+		g_free(line);
+	}
+
+	return len;
+}
+
+static size_t
+amztransport_curl_write(char *data, size_t size, size_t nmemb, void *userp)
+{
+	AMZTransportRequest *req = userp;
+
+	if (req->cancelled)
+		return 0;
+
+	if (!req->headers_done)
+		amztransport_curl_got_headers(req);
+
+	req->cb->got_chunk(req, data, size * nmemb, req->userdata);
+
+	return size * nmemb;
+}
+
+static AMZTransportRequest *
+amztransport_curl_start(AMZTransport *transport, const gchar *url,
+			const AMZTransportCallbacks *cb, gpointer userdata)
+{
+	AMZTransportCurl *t = (AMZTransportCurl *) transport;
+	AMZTransportRequest *req;
+
+	req = g_slice_new0(AMZTransportRequest);
+	req->transport = t;
+	req->cb = cb;
+	req->userdata = userdata;
+
+	req->easy = curl_easy_init();
+	curl_easy_setopt(req->easy, CURLOPT_URL, url);
+	curl_easy_setopt(req->easy, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(req->easy, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION, amztransport_curl_write);
+	curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, req);
+	curl_easy_setopt(req->easy, CURLOPT_HEADERFUNCTION, amztransport_curl_header);
+	curl_easy_setopt(req->easy, CURLOPT_HEADERDATA, req);
+	curl_easy_setopt(req->easy, CURLOPT_ERRORBUFFER, req->errbuf);
+	curl_easy_setopt(req->easy, CURLOPT_PRIVATE, req);
+
+	curl_multi_add_handle(t->multi, req->easy);
+
+	return req;
+}
+
+/*
+ * curl does not allow removing a handle from within its own callbacks,
+ * which is where the engine usually decides to cancel a request.  The
+ * request is parked and reported at the end of the next iteration.
+ */
+static void
+amztransport_curl_cancel(AMZTransport *transport, AMZTransportRequest *req)
+{
+	AMZTransportCurl *t = (AMZTransportCurl *) transport;
+
+	if (req->cancelled)
+		return;
+
+	req->cancelled = true;
+	g_queue_push_tail(t->cancelled, req);
+}
+
+static void
+amztransport_curl_finish(AMZTransportRequest *req, CURLcode result)
+{
+	long status = 0;
+	const gchar *reason;
+
+	if (!req->headers_done && result == CURLE_OK)
+		amztransport_curl_got_headers(req);
+
+	if (result == CURLE_OK)
+	{
+		curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &status);
+		reason = req->reason != NULL ? req->reason : "";
+	}
+	else
+	{
+		status = AMZ_TRANSPORT_STATUS_ERROR;
+		reason = *req->errbuf ? req->errbuf : curl_easy_strerror(result);
+	}
+
+	req->cb->finished(req, status, reason, req->userdata);
+	amztransport_curl_request_free(req);
+}
+
+static void
+amztransport_curl_iterate(AMZTransport *transport, guint timeout_ms)
+{
+	AMZTransportCurl *t = (AMZTransportCurl *) transport;
+	AMZTransportRequest *req;
+	struct epoll_event events[AMZTRANSPORT_CURL_EVENTS];
+	CURLMsg *msg;
+	gint64 wait = timeout_ms;
+	gint n, i, mask, pending, running;
+
+	if (!g_queue_is_empty(t->cancelled))
+		wait = 0;
+	else if (t->deadline >= 0)
+		wait = CLAMP(t->deadline - amztransport_curl_now(), 0, wait);
+
+	n = epoll_wait(t->epfd, events, G_N_ELEMENTS(events), wait);
+
+	for (i = 0; i < n; i++)
+	{
+		mask = 0;
+		if (events[i].events & EPOLLIN)
+			mask |= CURL_CSELECT_IN;
+		if (events[i].events & EPOLLOUT)
+			mask |= CURL_CSELECT_OUT;
+		if (events[i].events & (EPOLLERR | EPOLLHUP))
+			mask |= CURL_CSELECT_ERR;
+
+		curl_multi_socket_action(t->multi, events[i].data.fd, mask, &running);
+	}
+
+	if (t->deadline >= 0 && amztransport_curl_now() >= t->deadline)
+	{
+		t->deadline = -1;
+		curl_multi_socket_action(t->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	}
+
+	while ((msg = curl_multi_info_read(t->multi, &pending)) != NULL)
+	{
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &req);
+
+		/* reported with the other cancellations below. */
+		if (req->cancelled)
+			continue;
+
+		amztransport_curl_finish(req, msg->data.result);
+	}
+
+	while ((req = g_queue_pop_head(t->cancelled)) != NULL)
+	{
+		req->cb->finished(req, AMZ_TRANSPORT_STATUS_CANCELLED, "Cancelled", req->userdata);
+		amztransport_curl_request_free(req);
+	}
+}
+
+/*
+ * The epoll set is private to this backend, so nothing else drives it;
+ * polling it without waiting is all dispatch needs.
+ */
+static void
+amztransport_curl_dispatch(AMZTransport *transport)
+{
+	amztransport_curl_iterate(transport, 0);
+}
+
+const AMZTransportOps amztransport_curl_ops = {
+	"curl",
+	amztransport_curl_create,
+	amztransport_curl_destroy,
+	amztransport_curl_start,
+	amztransport_curl_cancel,
+	amztransport_curl_iterate,
+	amztransport_curl_dispatch,
+	NULL,
+};
+
+#endif
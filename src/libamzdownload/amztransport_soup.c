@@ -0,0 +1,216 @@
+/*
+ * libamz: library for accessing, manipulating and decrypting amz files.
+ * amztransport_soup.c: libsoup transport.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include "amztransport.h"
+
+typedef struct {
+	AMZTransport parent;
+	SoupSession *session;
+	GQueue *completed;
+} AMZTransportSoup;
+
+struct _AMZTransportRequest {
+	AMZTransportSoup *transport;
+	SoupMessage *msg;
+	const AMZTransportCallbacks *cb;
+	gpointer userdata;
+	guint status;
+	gchar *reason;
+};
+
+static AMZTransport *
+amztransport_soup_create(void)
+{
+	AMZTransportSoup *t;
+
+	/* callers no longer see libsoup, so they cannot be expected to do this. */
+	g_type_init();
+
+	t = g_new0(AMZTransportSoup, 1);
+	t->parent.ops = &amztransport_soup_ops;
+	t->session = soup_session_async_new();
+	t->completed = g_queue_new();
+
+	return &t->parent;
+}
+
+static void
+amztransport_soup_request_free(AMZTransportRequest *req)
+{
+	g_free(req->reason);
+	g_slice_free(AMZTransportRequest, req);
+}
+
+static void
+amztransport_soup_destroy(AMZTransport *transport)
+{
+	AMZTransportSoup *t = (AMZTransportSoup *) transport;
+	AMZTransportRequest *req;
+
+	soup_session_abort(t->session);
+
+	while ((req = g_queue_pop_head(t->completed)) != NULL)
+		amztransport_soup_request_free(req);
+
+	g_queue_free(t->completed);
+	g_object_unref(t->session);
+	g_free(t);
+}
+
+static void
+amztransport_soup_got_headers(SoupMessage *msg, AMZTransportRequest *req)
+{
+	req->cb->got_headers(req, msg->status_code,
+		soup_message_headers_get_content_length(msg->response_headers), req->userdata);
+}
+
+static void
+amztransport_soup_got_chunk(SoupMessage *msg, SoupBuffer *chunk, AMZTransportRequest *req)
+{
+	req->cb->got_chunk(req, chunk->data, chunk->length, req->userdata);
+}
+
+static void
+amztransport_soup_finished(SoupSession *session, SoupMessage *msg, gpointer userdata)
+{
+	AMZTransportRequest *req = userdata;
+
+	req->status = msg->status_code;
+	if (SOUP_STATUS_IS_TRANSPORT_ERROR(req->status) && req->status != SOUP_STATUS_CANCELLED)
+		req->status = AMZ_TRANSPORT_STATUS_ERROR;
+
+	req->reason = g_strdup(msg->reason_phrase);
+	req->msg = NULL;
+
+	g_queue_push_tail(req->transport->completed, req);
+}
+
+static AMZTransportRequest *
+amztransport_soup_start(AMZTransport *transport, const gchar *url,
+			const AMZTransportCallbacks *cb, gpointer userdata)
+{
+	AMZTransportSoup *t = (AMZTransportSoup *) transport;
+	AMZTransportRequest *req;
+
+	req = g_slice_new0(AMZTransportRequest);
+	req->transport = t;
+	req->cb = cb;
+	req->userdata = userdata;
+
+	req->msg = soup_message_new(SOUP_METHOD_GET, url);
+	if (req->msg == NULL)
+	{
+		req->status = AMZ_TRANSPORT_STATUS_ERROR;
+		req->reason = g_strdup("Invalid URL");
+		g_queue_push_tail(t->completed, req);
+		return req;
+	}
+
+	/* the engine writes chunks out as they arrive; don't keep a copy. */
+	soup_message_body_set_accumulate(req->msg->response_body, FALSE);
+
+	g_signal_connect(req->msg, "got-headers", G_CALLBACK(amztransport_soup_got_headers), req);
+	g_signal_connect(req->msg, "got-chunk", G_CALLBACK(amztransport_soup_got_chunk), req);
+
+	soup_session_queue_message(t->session, req->msg, amztransport_soup_finished, req);
+
+	return req;
+}
+
+static void
+amztransport_soup_cancel(AMZTransport *transport, AMZTransportRequest *req)
+{
+	AMZTransportSoup *t = (AMZTransportSoup *) transport;
+
+	if (req->msg != NULL)
+		soup_session_cancel_message(t->session, req->msg, SOUP_STATUS_CANCELLED);
+}
+
+static gboolean
+amztransport_soup_expire(gpointer userdata)
+{
+	*(gboolean *) userdata = TRUE;
+
+	return FALSE;
+}
+
+static void
+amztransport_soup_dispatch(AMZTransport *transport)
+{
+	AMZTransportSoup *t = (AMZTransportSoup *) transport;
+	AMZTransportRequest *req;
+
+	while ((req = g_queue_pop_head(t->completed)) != NULL)
+	{
+		req->cb->finished(req, req->status, req->reason, req->userdata);
+		amztransport_soup_request_free(req);
+	}
+}
+
+static void
+amztransport_soup_iterate(AMZTransport *transport, guint timeout_ms)
+{
+	AMZTransportSoup *t = (AMZTransportSoup *) transport;
+	gboolean expired = FALSE;
+	guint source;
+
+	if (g_queue_is_empty(t->completed))
+	{
+		source = g_timeout_add(timeout_ms, amztransport_soup_expire, &expired);
+		g_main_context_iteration(NULL, TRUE);
+
+		if (!expired)
+			g_source_remove(source);
+	}
+
+	amztransport_soup_dispatch(transport);
+}
+
+/*
+ * libsoup queues requests beyond its per-host limit (2 by default) inside
+ * the session, where the engine would count them as stalled.
+ */
+static void
+amztransport_soup_set_max_connections(AMZTransport *transport, guint max_connections)
+{
+	AMZTransportSoup *t = (AMZTransportSoup *) transport;
+
+	g_object_set(t->session,
+		     SOUP_SESSION_MAX_CONNS, (gint) max_connections,
+		     SOUP_SESSION_MAX_CONNS_PER_HOST, (gint) max_connections,
+		     NULL);
+}
+
+const AMZTransportOps amztransport_soup_ops = {
+	"soup",
+	amztransport_soup_create,
+	amztransport_soup_destroy,
+	amztransport_soup_start,
+	amztransport_soup_cancel,
+	amztransport_soup_iterate,
+	amztransport_soup_dispatch,
+	amztransport_soup_set_max_connections,
+};
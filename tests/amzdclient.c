@@ -0,0 +1,713 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * amzdclient.c: the amzd wire protocol, driven from a client.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <glib/gstdio.h>
+
+#include "libamz.h"
+#include "amztest.h"
+
+/* kept in step with the protocol description in src/amzd/amzd.c. */
+#define AMZD_STATUS_OK		0
+#define AMZD_STATUS_ERROR	1
+#define AMZD_STATUS_TOO_LARGE	2
+#define AMZD_STATUS_BAD_REQUEST	3
+
+#define AMZD_HEADER_LEN		5
+
+/* fewer threads than the slow-clients test opens connections. */
+#define AMZD_THREADS		"2"
+#define AMZD_MAX_REQUEST	4096
+
+/* how long a client waits for any one reply. */
+#define AMZD_REPLY_TIMEOUT	5
+
+static const gchar xspf[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<playlist version=\"1\" xmlns=\"http://xspf.org/ns/0/\"><trackList>\n"
+	"<track><location>http://127.0.0.1/a.mp3</location><creator>Creator</creator>"
+	"<album>Album</album><title>One</title><trackNum>1</trackNum></track>\n"
+	"<track><location>http://127.0.0.1/b.mp3</location><creator>Creator</creator>"
+	"<album>Album</album><title>Two</title><trackNum>2</trackNum></track>\n"
+	"</trackList></playlist>\n";
+
+static const gchar *amzd_path;
+static AMZTestFunc current;
+static GPid daemon_pid;
+static gchar *socket_path;
+
+static gchar *
+write_amz(AMZTestEnv *env)
+{
+	gchar *path, *data;
+
+	path = amztest_path(env, "album.amz");
+	data = amztest_encode_amz(xspf);
+	g_file_set_contents(path, data, -1, NULL);
+	g_free(data);
+
+	return path;
+}
+
+static gint
+client_connect_to(const gchar *path)
+{
+	struct sockaddr_un sun;
+	struct timeval tv = { AMZD_REPLY_TIMEOUT, 0 };
+	gint fd;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	g_strlcpy(sun.sun_path, path, sizeof sun.sun_path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) &sun, sizeof sun) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+	return fd;
+}
+
+static gint
+client_connect(void)
+{
+	return client_connect_to(socket_path);
+}
+
+static bool
+client_write(gint fd, gconstpointer data, gsize len)
+{
+	const gchar *p = data;
+	gssize r;
+
+	while (len > 0)
+	{
+		if ((r = send(fd, p, len, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		p += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+static bool
+client_read(gint fd, gpointer data, gsize len)
+{
+	gchar *p = data;
+	gssize r;
+
+	while (len > 0)
+	{
+		if ((r = read(fd, p, len)) < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+
+		p += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+/* sends a header claiming len bytes of payload, followed by len bytes of data. */
+static bool
+client_send(gint fd, guchar op, gconstpointer data, guint32 len)
+{
+	guchar header[AMZD_HEADER_LEN];
+	guint32 belen = GUINT32_TO_BE(len);
+
+	header[0] = op;
+	memcpy(header + 1, &belen, sizeof belen);
+
+	return client_write(fd, header, sizeof header) && client_write(fd, data, len);
+}
+
+static bool
+client_send_string(gint fd, guchar op, const gchar *str)
+{
+	return client_send(fd, op, str, strlen(str));
+}
+
+/* reads one reply; the payload is NUL-terminated for convenience. */
+static bool
+client_recv(gint fd, guchar *status, gchar **data, gsize *len)
+{
+	guchar header[AMZD_HEADER_LEN];
+	guint32 belen;
+
+	if (!client_read(fd, header, sizeof header))
+		return false;
+
+	memcpy(&belen, header + 1, sizeof belen);
+	*status = header[0];
+	*len = GUINT32_FROM_BE(belen);
+	*data = g_malloc(*len + 1);
+	(*data)[*len] = '\0';
+
+	if (!client_read(fd, *data, *len))
+	{
+		g_free(*data);
+		return false;
+	}
+
+	return true;
+}
+
+/* reads one reply and checks only its status. */
+static bool
+client_expect(gint fd, guchar expected)
+{
+	guchar status;
+	gchar *data;
+	gsize len;
+
+	if (!client_recv(fd, &status, &data, &len))
+		return false;
+
+	g_free(data);
+
+	return status == expected;
+}
+
+static bool
+client_expect_eof(gint fd)
+{
+	gchar c;
+
+	return read(fd, &c, 1) == 0;
+}
+
+static bool
+expect_document(gint fd)
+{
+	guchar status;
+	gchar *data;
+	gsize len;
+	bool ret;
+
+	if (!client_recv(fd, &status, &data, &len))
+		return false;
+
+	ret = status == AMZD_STATUS_OK && len == strlen(xspf) && !memcmp(data, xspf, len);
+	g_free(data);
+
+	return ret;
+}
+
+/* checks the entry count and the first entry's location, title, creator, album and tracknum. */
+static bool
+expect_track_list(gint fd)
+{
+	static const gchar *first[] = { "http://127.0.0.1/a.mp3", "One", "Creator", "Album", "1" };
+	guchar status;
+	gchar *data, *p;
+	gsize len;
+	guint32 count;
+	guint i;
+	bool ret;
+
+	if (!client_recv(fd, &status, &data, &len))
+		return false;
+
+	ret = status == AMZD_STATUS_OK && len > sizeof count;
+	if (ret)
+	{
+		memcpy(&count, data, sizeof count);
+		ret = GUINT32_FROM_BE(count) == 2;
+	}
+
+	for (i = 0, p = data + sizeof count; ret && i < G_N_ELEMENTS(first); i++)
+	{
+		ret = p < data + len && !strcmp(p, first[i]);
+		p += strlen(p) + 1;
+	}
+
+	g_free(data);
+
+	return ret;
+}
+
+static void
+test_decrypt_path(AMZTestEnv *env)
+{
+	gchar *path = write_amz(env);
+	gint fd;
+
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'd', path));
+	AMZTEST_CHECK(env, expect_document(fd));
+
+	close(fd);
+	g_free(path);
+}
+
+static void
+test_decrypt_blob(AMZTestEnv *env)
+{
+	gchar *amz = amztest_encode_amz(xspf);
+	gint fd;
+
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'D', amz));
+	AMZTEST_CHECK(env, expect_document(fd));
+
+	close(fd);
+	g_free(amz);
+}
+
+static void
+test_parse_path(AMZTestEnv *env)
+{
+	gchar *path = write_amz(env);
+	gint fd;
+
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'l', path));
+	AMZTEST_CHECK(env, expect_track_list(fd));
+
+	close(fd);
+	g_free(path);
+}
+
+static void
+test_parse_blob(AMZTestEnv *env)
+{
+	gchar *amz = amztest_encode_amz(xspf);
+	gint fd;
+
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'L', amz));
+	AMZTEST_CHECK(env, expect_track_list(fd));
+
+	close(fd);
+	g_free(amz);
+}
+
+/* an empty playlist is a valid one; a document that is not XSPF is not. */
+static void
+test_empty_playlist(AMZTestEnv *env)
+{
+	static const guint32 zero = 0;
+	gchar *empty = amztest_encode_amz("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+				  "<playlist version=\"1\" xmlns=\"http://xspf.org/ns/0/\"><trackList/></playlist>\n");
+	gchar *broken = amztest_encode_amz("this is not xml\n");
+	guchar status;
+	gchar *data;
+	gsize len;
+	gint fd;
+
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'L', empty));
+	AMZTEST_CHECK(env, client_recv(fd, &status, &data, &len));
+	AMZTEST_CHECK(env, status == AMZD_STATUS_OK && len == sizeof zero && !memcmp(data, &zero, len));
+	g_free(data);
+
+	AMZTEST_CHECK(env, client_send_string(fd, 'L', broken));
+	AMZTEST_CHECK(env, client_expect(fd, AMZD_STATUS_ERROR));
+
+	close(fd);
+	g_free(broken);
+	g_free(empty);
+}
+
+/* requests written back to back are answered in order. */
+static void
+test_pipelined(AMZTestEnv *env)
+{
+	gchar *amz = amztest_encode_amz(xspf);
+	gint fd;
+
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'L', amz));
+	AMZTEST_CHECK(env, client_send_string(fd, 'D', amz));
+	AMZTEST_CHECK(env, expect_track_list(fd));
+	AMZTEST_CHECK(env, expect_document(fd));
+
+	close(fd);
+	g_free(amz);
+}
+
+/* an error is reported on a connection that stays usable. */
+static void
+test_missing_path(AMZTestEnv *env)
+{
+	gchar *path = amztest_path(env, "missing.amz");
+	gchar *amz = amztest_encode_amz(xspf);
+	gint fd;
+
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'd', path));
+	AMZTEST_CHECK(env, client_expect(fd, AMZD_STATUS_ERROR));
+	AMZTEST_CHECK(env, client_send_string(fd, 'D', amz));
+	AMZTEST_CHECK(env, expect_document(fd));
+
+	close(fd);
+	g_free(amz);
+	g_free(path);
+}
+
+static void
+test_bad_opcode(AMZTestEnv *env)
+{
+	gchar *amz = amztest_encode_amz(xspf);
+	gint fd;
+
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'x', "payload"));
+	AMZTEST_CHECK(env, client_expect(fd, AMZD_STATUS_BAD_REQUEST));
+	AMZTEST_CHECK(env, client_send(fd, '\0', NULL, 0));
+	AMZTEST_CHECK(env, client_expect(fd, AMZD_STATUS_BAD_REQUEST));
+	AMZTEST_CHECK(env, client_send_string(fd, 'D', amz));
+	AMZTEST_CHECK(env, expect_document(fd));
+
+	close(fd);
+	g_free(amz);
+}
+
+/* the payload of an oversized request is never read, so the connection is closed. */
+static void
+test_request_too_large(AMZTestEnv *env)
+{
+	guchar header[AMZD_HEADER_LEN] = { 'D', 0x00, 0x10, 0x00, 0x00 };
+	gint fd;
+
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_write(fd, header, sizeof header));
+	AMZTEST_CHECK(env, client_expect(fd, AMZD_STATUS_TOO_LARGE));
+	AMZTEST_CHECK(env, client_expect_eof(fd));
+
+	close(fd);
+}
+
+/* an oversized file, on the other hand, leaves the connection in step. */
+static void
+test_file_too_large(AMZTestEnv *env)
+{
+	gchar *path = amztest_path(env, "large.amz");
+	gchar *data = g_strnfill(AMZD_MAX_REQUEST + 1, 'A');
+	gchar *amz = amztest_encode_amz(xspf);
+	gint fd;
+
+	AMZTEST_CHECK(env, g_file_set_contents(path, data, -1, NULL));
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'l', path));
+	AMZTEST_CHECK(env, client_expect(fd, AMZD_STATUS_TOO_LARGE));
+	AMZTEST_CHECK(env, client_send_string(fd, 'D', amz));
+	AMZTEST_CHECK(env, expect_document(fd));
+
+	close(fd);
+	g_free(amz);
+	g_free(data);
+	g_free(path);
+}
+
+/*
+ * More clients than amzd has threads stop partway through a header or a
+ * payload.  A fresh client must still be answered promptly, and the slow
+ * ones once they finish their frames.
+ */
+static void
+test_slow_clients(AMZTestEnv *env)
+{
+	gchar *amz = amztest_encode_amz(xspf);
+	guint32 belen = GUINT32_TO_BE(strlen(amz));
+	gint slow[6], fd;
+	GTimer *timer;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(slow); i++)
+	{
+		AMZTEST_CHECK(env, (slow[i] = client_connect()) >= 0);
+		AMZTEST_CHECK(env, client_write(slow[i], "D", 1));
+
+		if (i % 2)
+			AMZTEST_CHECK(env, client_write(slow[i], &belen, sizeof belen) &&
+					   client_write(slow[i], amz, strlen(amz) / 2));
+	}
+
+	timer = g_timer_new();
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'D', amz));
+	AMZTEST_CHECK(env, expect_document(fd));
+	AMZTEST_CHECK(env, g_timer_elapsed(timer, NULL) < 1);
+	g_timer_destroy(timer);
+	close(fd);
+
+	for (i = 0; i < G_N_ELEMENTS(slow); i++)
+	{
+		if (i % 2)
+			AMZTEST_CHECK(env, client_write(slow[i], amz + strlen(amz) / 2, strlen(amz) - strlen(amz) / 2));
+		else
+			AMZTEST_CHECK(env, client_write(slow[i], &belen, sizeof belen) &&
+					   client_write(slow[i], amz, strlen(amz)));
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(slow); i++)
+	{
+		AMZTEST_CHECK(env, expect_document(slow[i]));
+		close(slow[i]);
+	}
+
+	g_free(amz);
+}
+
+static bool
+amzd_spawn(const gchar *path, GPid *pid)
+{
+	gchar *argv[] = { (gchar *) amzd_path, "--socket", (gchar *) path, "--threads", AMZD_THREADS,
+			  "--max-request", NULL, NULL };
+	gchar max_request[16];
+
+	g_snprintf(max_request, sizeof max_request, "%d", AMZD_MAX_REQUEST);
+	argv[6] = max_request;
+
+	return g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDERR_TO_DEV_NULL,
+			     NULL, NULL, pid, NULL);
+}
+
+/* waits up to five seconds for pid to exit, returning its wait status, or -1. */
+static gint
+amzd_wait(GPid pid)
+{
+	gint status, i;
+
+	for (i = 0; i < 500; i++)
+	{
+		if (waitpid(pid, &status, WNOHANG) == pid)
+		{
+			g_spawn_close_pid(pid);
+			return status;
+		}
+
+		g_usleep(10000);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	g_spawn_close_pid(pid);
+
+	return -1;
+}
+
+/* waits up to five seconds for a daemon to start listening on path. */
+static bool
+amzd_listening(const gchar *path)
+{
+	gint fd, i;
+
+	for (i = 0; i < 500; i++)
+	{
+		if ((fd = client_connect_to(path)) >= 0)
+		{
+			close(fd);
+			return true;
+		}
+
+		g_usleep(10000);
+	}
+
+	return false;
+}
+
+/* a second daemon on path must exit with an error of its own accord. */
+static bool
+amzd_refuses(const gchar *path)
+{
+	GPid pid;
+	gint status;
+
+	if (!amzd_spawn(path, &pid))
+		return false;
+
+	status = amzd_wait(pid);
+
+	return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) != 0;
+}
+
+static bool
+amzd_start(AMZTestEnv *env)
+{
+	socket_path = amztest_path(env, "amzd.sock");
+
+	return amzd_spawn(socket_path, &daemon_pid) && amzd_listening(socket_path);
+}
+
+/* amzd must exit cleanly on SIGTERM, taking its socket with it. */
+static bool
+amzd_stop(void)
+{
+	gint status;
+	bool ret;
+
+	kill(daemon_pid, SIGTERM);
+	status = amzd_wait(daemon_pid);
+	ret = status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+		!g_file_test(socket_path, G_FILE_TEST_EXISTS);
+
+	g_free(socket_path);
+	socket_path = NULL;
+
+	return ret;
+}
+
+/* a daemon already listening keeps its socket, and keeps serving. */
+static void
+test_socket_in_use(AMZTestEnv *env)
+{
+	gchar *amz = amztest_encode_amz(xspf);
+	gint fd;
+
+	AMZTEST_CHECK(env, amzd_refuses(socket_path));
+	AMZTEST_CHECK(env, (fd = client_connect()) >= 0);
+	AMZTEST_CHECK(env, client_send_string(fd, 'D', amz));
+	AMZTEST_CHECK(env, expect_document(fd));
+
+	close(fd);
+	g_free(amz);
+}
+
+/* a mistyped --socket must not cost the user a file. */
+static void
+test_not_a_socket(AMZTestEnv *env)
+{
+	gchar *path = amztest_path(env, "notes.txt");
+	gchar *data = NULL;
+
+	AMZTEST_CHECK(env, g_file_set_contents(path, "keep me", -1, NULL));
+	AMZTEST_CHECK(env, amzd_refuses(path));
+	AMZTEST_CHECK(env, g_file_get_contents(path, &data, NULL, NULL) && !strcmp(data, "keep me"));
+
+	g_free(data);
+	g_free(path);
+}
+
+/* a socket left behind by a daemon that died is taken over. */
+static void
+test_stale_socket(AMZTestEnv *env)
+{
+	struct sockaddr_un sun;
+	gchar *path = amztest_path(env, "stale.sock");
+	GPid pid;
+	gint fd, status;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	g_strlcpy(sun.sun_path, path, sizeof sun.sun_path);
+
+	AMZTEST_CHECK(env, (fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+	AMZTEST_CHECK(env, bind(fd, (struct sockaddr *) &sun, sizeof sun) == 0);
+	close(fd);
+
+	AMZTEST_CHECK(env, amzd_spawn(path, &pid));
+	AMZTEST_CHECK(env, amzd_listening(path));
+
+	kill(pid, SIGTERM);
+	status = amzd_wait(pid);
+	AMZTEST_CHECK(env, status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	g_free(path);
+}
+
+/* every test gets its own daemon, listening in its scratch directory. */
+static void
+with_amzd(AMZTestEnv *env)
+{
+	bool stopped;
+
+	AMZTEST_CHECK(env, amzd_start(env));
+
+	current(env);
+
+	stopped = amzd_stop();
+	AMZTEST_CHECK(env, stopped);
+}
+
+static const struct {
+	const gchar *name;
+	AMZTestFunc func;
+} tests[] = {
+	{ "decrypt-path", test_decrypt_path },
+	{ "decrypt-blob", test_decrypt_blob },
+	{ "parse-path", test_parse_path },
+	{ "parse-blob", test_parse_blob },
+	{ "empty-playlist", test_empty_playlist },
+	{ "pipelined", test_pipelined },
+	{ "missing-path", test_missing_path },
+	{ "bad-opcode", test_bad_opcode },
+	{ "request-too-large", test_request_too_large },
+	{ "file-too-large", test_file_too_large },
+	{ "slow-clients", test_slow_clients },
+	{ "socket-in-use", test_socket_in_use },
+	{ "not-a-socket", test_not_a_socket },
+	{ "stale-socket", test_stale_socket },
+};
+
+void
+amzd_tests(AMZTestEnv *env, const gchar *path)
+{
+	gchar *name;
+	guint i;
+
+	if (path == NULL || !g_file_test(path, G_FILE_TEST_IS_EXECUTABLE))
+	{
+		printf("SKIP amzd: no amzd binary given\n");
+		return;
+	}
+
+	amzd_path = path;
+
+	for (i = 0; i < G_N_ELEMENTS(tests); i++)
+	{
+		name = g_strdup_printf("amzd/%s", tests[i].name);
+		current = tests[i].func;
+		amztest_run(env, name, with_amzd);
+		g_free(name);
+	}
+}
@@ -0,0 +1,215 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * amztest.c: test runner and shared helpers.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+#include <gcrypt.h>
+
+#include "amztest.h"
+
+/* a test that hangs is killed by SIGALRM, which fails the run. */
+#define AMZTEST_TIMEOUT		60
+
+static guint passed = 0, failed = 0;
+
+void
+amztest_fail(AMZTestEnv *env, const gchar *file, gint line, const gchar *expr)
+{
+	fprintf(stderr, "    %s:%d: check failed: %s\n", file, line, expr);
+	env->failed = true;
+}
+
+static void
+amztest_remove(const gchar *dir)
+{
+	GDir *d;
+	const gchar *name;
+	gchar *path;
+
+	if ((d = g_dir_open(dir, 0, NULL)) != NULL)
+	{
+		while ((name = g_dir_read_name(d)) != NULL)
+		{
+			path = g_build_filename(dir, name, NULL);
+			if (g_file_test(path, G_FILE_TEST_IS_DIR) && !g_file_test(path, G_FILE_TEST_IS_SYMLINK))
+				amztest_remove(path);
+			else
+				g_unlink(path);
+			g_free(path);
+		}
+
+		g_dir_close(d);
+	}
+
+	g_rmdir(dir);
+}
+
+void
+amztest_run(AMZTestEnv *env, const gchar *name, AMZTestFunc func)
+{
+	gchar *template;
+
+	template = g_build_filename(g_get_tmp_dir(), "amztest.XXXXXX", NULL);
+	if (mkdtemp(template) == NULL)
+	{
+		fprintf(stderr, "FAIL %s: cannot create %s\n", name, template);
+		g_free(template);
+		failed++;
+		return;
+	}
+
+	env->dir = template;
+	env->failed = false;
+
+	alarm(AMZTEST_TIMEOUT);
+	func(env);
+	alarm(0);
+
+	printf("%s %s\n", env->failed ? "FAIL" : "PASS", name);
+	fflush(stdout);
+
+	if (env->failed)
+		failed++;
+	else
+		passed++;
+
+	amztest_remove(env->dir);
+	g_free(env->dir);
+	env->dir = NULL;
+}
+
+gchar *
+amztest_path(AMZTestEnv *env, const gchar *name)
+{
+	return g_build_filename(env->dir, name, NULL);
+}
+
+/* checks that path holds exactly the len bytes the stub server sends. */
+bool
+amztest_file_matches(const gchar *path, gsize len)
+{
+	gchar *data;
+	gsize i, size;
+	bool ret;
+
+	if (!g_file_get_contents(path, &data, &size, NULL))
+		return false;
+
+	for (i = 0, ret = size == len; ret && i < size; i++)
+		ret = data[i] == HTTPSTUB_BYTE(i);
+
+	g_free(data);
+
+	return ret;
+}
+
+/* counts the .partN files left behind in the scratch directory. */
+guint
+amztest_count_partials(AMZTestEnv *env)
+{
+	GDir *d;
+	const gchar *name;
+	guint count = 0;
+
+	if ((d = g_dir_open(env->dir, 0, NULL)) == NULL)
+		return 0;
+
+	while ((name = g_dir_read_name(d)) != NULL)
+	{
+		if (strstr(name, ".part") != NULL)
+			count++;
+	}
+
+	g_dir_close(d);
+
+	return count;
+}
+
+/*
+ * Encrypts the document the way the store does, so that the tests have real
+ * .amz files to chew on.
+ */
+gchar *
+amztest_encode_amz(const gchar *doc)
+{
+	static const guchar key[8] = { 0x29, 0xAB, 0x9D, 0x18, 0xB2, 0x44, 0x9E, 0x31 };
+	static const guchar iv[8]  = { 0x5E, 0x72, 0xD7, 0x9A, 0x11, 0xB3, 0x4F, 0xEE };
+	gcry_cipher_hd_t hd;
+	guchar *buf;
+	gsize len;
+	gchar *ret = NULL;
+
+	len = (strlen(doc) + 7) & ~7;
+	buf = g_malloc0(len);
+	memcpy(buf, doc, strlen(doc));
+
+	if (!gcry_cipher_open(&hd, GCRY_CIPHER_DES, GCRY_CIPHER_MODE_CBC, 0))
+	{
+		if (!gcry_cipher_setkey(hd, key, sizeof key) && !gcry_cipher_setiv(hd, iv, sizeof iv) &&
+		    !gcry_cipher_encrypt(hd, buf, len, NULL, 0))
+			ret = g_base64_encode(buf, len);
+
+		gcry_cipher_close(hd);
+	}
+
+	g_free(buf);
+
+	return ret;
+}
+
+int
+main(gint argc, gchar *argv[])
+{
+	AMZTestEnv env;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	gcry_check_version(NULL);
+
+	memset(&env, 0, sizeof env);
+
+	if ((env.stub = httpstub_new()) == NULL)
+		return EXIT_FAILURE;
+
+	playlist_tests(&env);
+	tag_tests(&env);
+	transport_tests(&env);
+	hedge_tests(&env);
+	pipeline_tests(&env);
+	amzd_tests(&env, argc > 1 ? argv[1] : NULL);
+
+	httpstub_free(env.stub);
+
+	printf("%u passed, %u failed\n", passed, failed);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
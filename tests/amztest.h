@@ -0,0 +1,69 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * amztest.h: shared test runner declarations.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+#include <stdbool.h>
+
+#include "httpstub.h"
+
+#ifndef __AMZTEST_H__
+#define __AMZTEST_H__
+
+/*
+ * A test gets a fresh scratch directory, removed again afterwards, and
+ * ends at the first check that fails.
+ */
+typedef struct {
+	const gchar *transport;
+	HTTPStub *stub;
+	gchar *dir;
+	bool failed;
+} AMZTestEnv;
+
+typedef void (*AMZTestFunc)(AMZTestEnv *env);
+
+#define AMZTEST_CHECK(env, expr)						\
+	do {									\
+		if (!(expr))							\
+		{								\
+			amztest_fail((env), __FILE__, __LINE__, #expr);		\
+			return;							\
+		}								\
+	} while (0)
+
+void amztest_fail(AMZTestEnv *env, const gchar *file, gint line, const gchar *expr);
+void amztest_run(AMZTestEnv *env, const gchar *name, AMZTestFunc func);
+
+gchar *amztest_path(AMZTestEnv *env, const gchar *name);
+bool amztest_file_matches(const gchar *path, gsize len);
+guint amztest_count_partials(AMZTestEnv *env);
+gchar *amztest_encode_amz(const gchar *doc);
+
+void playlist_tests(AMZTestEnv *env);
+void tag_tests(AMZTestEnv *env);
+void transport_tests(AMZTestEnv *env);
+void hedge_tests(AMZTestEnv *env);
+void pipeline_tests(AMZTestEnv *env);
+void amzd_tests(AMZTestEnv *env, const gchar *path);
+
+#endif
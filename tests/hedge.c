@@ -0,0 +1,281 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * hedge.c: hedged requests against stalled and slow responses.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "amzdownload.h"
+#include "amztest.h"
+
+/*
+ * The /once/ routes stall or trickle only on their first hit, so a hedge
+ * sent for them is answered at once and wins.
+ */
+static const gchar *transports[] = { "soup", "curl", NULL };
+
+typedef struct {
+	bool finished;
+	bool success;
+	bool hedged;
+	bool saw_partial;
+	gchar *first_part;
+} HedgeResult;
+
+static void
+hedge_progress(AMZDownloadContext *ctx)
+{
+	HedgeResult *result = ctx->userdata;
+
+	if (result->first_part != NULL && g_file_test(result->first_part, G_FILE_TEST_EXISTS))
+		result->saw_partial = true;
+}
+
+static void
+hedge_finished(AMZDownloadContext *ctx)
+{
+	HedgeResult *result = ctx->userdata;
+
+	result->finished = true;
+	result->success = ctx->success;
+	result->hedged = ctx->hedged;
+}
+
+static void
+hedge_queue(AMZTestEnv *env, AMZDownloadSession *session, const gchar *route, const gchar *name,
+	    HedgeResult *result)
+{
+	gchar *url, *path;
+
+	memset(result, 0, sizeof *result);
+
+	url = httpstub_url(env->stub, route);
+	path = amztest_path(env, name);
+	result->first_part = g_strdup_printf("%s.part0", path);
+
+	amzdownload_session_queue_url(session, url, path, hedge_progress, hedge_finished, result);
+
+	g_free(path);
+	g_free(url);
+}
+
+/*
+ * A hedging session that has seen a few fast responses, so that its time
+ * to first byte and throughput percentiles are taken from real samples.
+ */
+static AMZDownloadSession *
+hedge_session(AMZTestEnv *env)
+{
+	AMZDownloadSession *session;
+	HedgeResult result;
+	gchar *name;
+	guint i;
+
+	session = amzdownload_session_new_with_transport(env->transport);
+	amzdownload_session_set_hedging(session, true, 0);
+
+	for (i = 0; i < 4; i++)
+	{
+		name = g_strdup_printf("warmup%u", i);
+		hedge_queue(env, session, "/ok/200000", name, &result);
+		amzdownload_session_run(session);
+		g_free(result.first_part);
+		g_free(name);
+
+		if (!result.success)
+		{
+			amzdownload_session_free(session);
+			return NULL;
+		}
+	}
+
+	return session;
+}
+
+static bool
+hedge_matches(AMZTestEnv *env, const gchar *name, gsize len)
+{
+	gchar *path;
+	bool ret;
+
+	path = amztest_path(env, name);
+	ret = amztest_file_matches(path, len);
+	g_free(path);
+
+	return ret;
+}
+
+/* no first byte for five seconds: the hedge must answer long before that. */
+static void
+test_stalled_first_byte(AMZTestEnv *env)
+{
+	AMZDownloadSession *session;
+	HedgeResult result;
+	GTimer *timer;
+	gchar *tag, *route;
+
+	AMZTEST_CHECK(env, (session = hedge_session(env)) != NULL);
+
+	tag = g_strdup_printf("/once/%s-stall", env->transport);
+	route = g_strconcat(tag, "/stall/5000/50000", NULL);
+
+	timer = g_timer_new();
+	hedge_queue(env, session, route, "stalled", &result);
+	amzdownload_session_run(session);
+
+	AMZTEST_CHECK(env, result.success && result.hedged);
+	AMZTEST_CHECK(env, g_timer_elapsed(timer, NULL) < 2.5);
+	AMZTEST_CHECK(env, httpstub_hits(env->stub, tag) == 2);
+	AMZTEST_CHECK(env, hedge_matches(env, "stalled", 50000));
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+
+	g_free(result.first_part);
+	g_free(route);
+	g_free(tag);
+	g_timer_destroy(timer);
+	amzdownload_session_free(session);
+}
+
+/*
+ * A body trickling in at 5 KiB/s gets a hedge that overtakes it; the
+ * original's .part0, which had data in it, must be gone afterwards.
+ */
+static void
+test_slow_body(AMZTestEnv *env)
+{
+	AMZDownloadSession *session;
+	HedgeResult result;
+	GTimer *timer;
+	gchar *tag, *route;
+
+	AMZTEST_CHECK(env, (session = hedge_session(env)) != NULL);
+
+	tag = g_strdup_printf("/once/%s-slow", env->transport);
+	route = g_strconcat(tag, "/slow/200/400000", NULL);
+
+	timer = g_timer_new();
+	hedge_queue(env, session, route, "slow", &result);
+	amzdownload_session_run(session);
+
+	AMZTEST_CHECK(env, result.success && result.hedged);
+	AMZTEST_CHECK(env, result.saw_partial);
+	AMZTEST_CHECK(env, g_timer_elapsed(timer, NULL) < 5);
+	AMZTEST_CHECK(env, httpstub_hits(env->stub, tag) == 2);
+	AMZTEST_CHECK(env, hedge_matches(env, "slow", 400000));
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+
+	g_free(result.first_part);
+	g_free(route);
+	g_free(tag);
+	g_timer_destroy(timer);
+	amzdownload_session_free(session);
+}
+
+/*
+ * Ten transfers stall at once.  With the default ratio of 0.1 and a burst
+ * of one, 14 transfers leave room for three hedges and no more; the rest
+ * must wait out their stall.
+ */
+static void
+test_cap(AMZTestEnv *env)
+{
+	AMZDownloadSession *session;
+	HedgeResult results[10];
+	gchar *route, *name, *tag;
+	guint i, hedged = 0, hits = 0;
+
+	AMZTEST_CHECK(env, (session = hedge_session(env)) != NULL);
+	amzdownload_session_set_max_transfers(session, 20);
+
+	for (i = 0; i < G_N_ELEMENTS(results); i++)
+	{
+		route = g_strdup_printf("/once/%s-cap%u/stall/3000/1000", env->transport, i);
+		name = g_strdup_printf("cap%u", i);
+		hedge_queue(env, session, route, name, &results[i]);
+		g_free(name);
+		g_free(route);
+	}
+
+	amzdownload_session_run(session);
+
+	for (i = 0; i < G_N_ELEMENTS(results); i++)
+	{
+		tag = g_strdup_printf("/once/%s-cap%u", env->transport, i);
+		hits += httpstub_hits(env->stub, tag);
+		g_free(tag);
+
+		if (results[i].hedged)
+			hedged++;
+
+		g_free(results[i].first_part);
+		AMZTEST_CHECK(env, results[i].success);
+	}
+
+	AMZTEST_CHECK(env, hedged == 3);
+	AMZTEST_CHECK(env, hits == G_N_ELEMENTS(results) + hedged);
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+
+	amzdownload_session_free(session);
+}
+
+static const struct {
+	const gchar *name;
+	AMZTestFunc func;
+} tests[] = {
+	{ "stalled-first-byte", test_stalled_first_byte },
+	{ "slow-body", test_slow_body },
+	{ "cap", test_cap },
+};
+
+void
+hedge_tests(AMZTestEnv *env)
+{
+	AMZDownloadSession *session;
+	gchar *name;
+	guint i, j;
+
+	for (i = 0; transports[i] != NULL; i++)
+	{
+		env->transport = transports[i];
+
+		if ((session = amzdownload_session_new_with_transport(env->transport)) == NULL)
+		{
+			printf("SKIP hedge/%s: not available\n", env->transport);
+			continue;
+		}
+
+		amzdownload_session_free(session);
+
+		for (j = 0; j < G_N_ELEMENTS(tests); j++)
+		{
+			name = g_strdup_printf("hedge/%s/%s", env->transport, tests[j].name);
+			amztest_run(env, name, tests[j].func);
+			g_free(name);
+		}
+	}
+
+	env->transport = NULL;
+}
@@ -0,0 +1,376 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * httpstub.c: scripted HTTP server on the loopback interface.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "httpstub.h"
+
+#define HTTPSTUB_SLICE_MS	10
+#define HTTPSTUB_CHUNK		1024
+
+struct _HTTPStub {
+	gint fd;
+	guint16 port;
+	GThread *thread;
+	GMutex *lock;
+	GCond *idle;
+	GHashTable *hits;
+	guint clients;
+	gint stopping;
+};
+
+typedef struct {
+	HTTPStub *stub;
+	gint fd;
+} HTTPStubClient;
+
+/* sleeps in short slices so that httpstub_free() is never held up for long. */
+static bool
+httpstub_sleep(HTTPStub *stub, guint ms)
+{
+	guint slept;
+
+	for (slept = 0; slept < ms; slept += HTTPSTUB_SLICE_MS)
+	{
+		if (g_atomic_int_get(&stub->stopping))
+			return false;
+
+		g_usleep(MIN(ms - slept, HTTPSTUB_SLICE_MS) * 1000);
+	}
+
+	return !g_atomic_int_get(&stub->stopping);
+}
+
+static bool
+httpstub_send(gint fd, const gchar *data, gsize len)
+{
+	gssize n;
+
+	while (len > 0)
+	{
+		if ((n = send(fd, data, len, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+httpstub_send_headers(gint fd, const gchar *status, const gchar *extra)
+{
+	gchar *headers;
+	bool ret;
+
+	headers = g_strdup_printf("HTTP/1.1 %s\r\nConnection: close\r\n%s\r\n", status, extra);
+	ret = httpstub_send(fd, headers, strlen(headers));
+	g_free(headers);
+
+	return ret;
+}
+
+/* sends bytes [from, to) of the body, pausing delay_ms before every chunk. */
+static bool
+httpstub_send_body(HTTPStub *stub, gint fd, gsize from, gsize to, guint delay_ms, bool chunked)
+{
+	gchar buf[HTTPSTUB_CHUNK];
+	gchar *size;
+	gsize i, n;
+	bool ret;
+
+	while (from < to)
+	{
+		if (delay_ms > 0 && !httpstub_sleep(stub, delay_ms))
+			return false;
+
+		n = MIN(to - from, sizeof buf);
+		for (i = 0; i < n; i++)
+			buf[i] = HTTPSTUB_BYTE(from + i);
+
+		if (chunked)
+		{
+			size = g_strdup_printf("%lx\r\n", (gulong) n);
+			ret = httpstub_send(fd, size, strlen(size));
+			g_free(size);
+
+			if (!ret)
+				return false;
+		}
+
+		if (!httpstub_send(fd, buf, n) || (chunked && !httpstub_send(fd, "\r\n", 2)))
+			return false;
+
+		from += n;
+	}
+
+	return !chunked || httpstub_send(fd, "0\r\n\r\n", 5);
+}
+
+static void
+httpstub_respond(HTTPStub *stub, gint fd, gchar **args, bool delay)
+{
+	struct linger linger = { 1, 0 };
+	gchar *headers;
+	gsize len;
+	guint ms;
+	bool stall;
+
+	if (args[0] == NULL)
+	{
+		httpstub_send_headers(fd, "404 Not Found", "Content-Length: 0\r\n");
+		return;
+	}
+
+	if (!strcmp(args[0], "ok") && args[1] != NULL)
+	{
+		len = g_ascii_strtoull(args[1], NULL, 10);
+		headers = g_strdup_printf("Content-Length: %lu\r\n", (gulong) len);
+
+		if (httpstub_send_headers(fd, "200 OK", headers))
+			httpstub_send_body(stub, fd, 0, len, 0, false);
+
+		g_free(headers);
+	}
+	else if (!strcmp(args[0], "redirect") && args[1] != NULL)
+	{
+		headers = g_strdup_printf("Location: /ok/%s\r\nContent-Length: 0\r\n", args[1]);
+		httpstub_send_headers(fd, "302 Found", headers);
+		g_free(headers);
+	}
+	else if (!strcmp(args[0], "chunked") && args[1] != NULL)
+	{
+		len = g_ascii_strtoull(args[1], NULL, 10);
+
+		if (httpstub_send_headers(fd, "200 OK", "Transfer-Encoding: chunked\r\n"))
+			httpstub_send_body(stub, fd, 0, len, 0, true);
+	}
+	else if ((!strcmp(args[0], "stall") || !strcmp(args[0], "slow")) && args[1] != NULL && args[2] != NULL)
+	{
+		stall = !strcmp(args[0], "stall");
+		ms = delay ? g_ascii_strtoull(args[1], NULL, 10) : 0;
+		len = g_ascii_strtoull(args[2], NULL, 10);
+		headers = g_strdup_printf("Content-Length: %lu\r\n", (gulong) len);
+
+		if ((!stall || httpstub_sleep(stub, ms)) && httpstub_send_headers(fd, "200 OK", headers))
+			httpstub_send_body(stub, fd, 0, len, stall ? 0 : ms, false);
+
+		g_free(headers);
+	}
+	else if (!strcmp(args[0], "reset") && args[1] != NULL)
+	{
+		len = g_ascii_strtoull(args[1], NULL, 10);
+		headers = g_strdup_printf("Content-Length: %lu\r\n", (gulong) len);
+
+		/* an abortive close sends RST instead of FIN. */
+		if (httpstub_send_headers(fd, "200 OK", headers) && httpstub_send_body(stub, fd, 0, len / 2, 0, false))
+		{
+			httpstub_sleep(stub, 50);
+			setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+		}
+
+		g_free(headers);
+	}
+	else
+		httpstub_send_headers(fd, "404 Not Found", "Content-Length: 0\r\n");
+}
+
+static gpointer
+httpstub_client(gpointer userdata)
+{
+	HTTPStubClient *client = userdata;
+	HTTPStub *stub = client->stub;
+	GString *request;
+	gchar buf[1024], path[1024], *key;
+	gchar **args;
+	gssize n;
+	guint hits;
+
+	request = g_string_new(NULL);
+
+	while (strstr(request->str, "\r\n\r\n") == NULL && (n = recv(client->fd, buf, sizeof buf, 0)) > 0)
+		g_string_append_len(request, buf, n);
+
+	if (sscanf(request->str, "GET %1023s ", path) == 1)
+	{
+		args = g_strsplit(path + 1, "/", 0);
+
+		/* /once/TAG/... is counted as a whole, but keyed on its tag. */
+		key = args[0] != NULL && !strcmp(args[0], "once") && args[1] != NULL ?
+			g_strdup_printf("/once/%s", args[1]) : g_strdup(path);
+
+		g_mutex_lock(stub->lock);
+		hits = GPOINTER_TO_UINT(g_hash_table_lookup(stub->hits, key)) + 1;
+		g_hash_table_replace(stub->hits, key, GUINT_TO_POINTER(hits));
+		g_mutex_unlock(stub->lock);
+
+		if (args[0] != NULL && !strcmp(args[0], "once") && args[1] != NULL)
+			httpstub_respond(stub, client->fd, args + 2, hits == 1);
+		else
+			httpstub_respond(stub, client->fd, args, true);
+
+		g_strfreev(args);
+	}
+
+	g_string_free(request, TRUE);
+	close(client->fd);
+	g_free(client);
+
+	g_mutex_lock(stub->lock);
+	if (--stub->clients == 0)
+		g_cond_broadcast(stub->idle);
+	g_mutex_unlock(stub->lock);
+
+	return NULL;
+}
+
+static gpointer
+httpstub_accept(gpointer userdata)
+{
+	HTTPStub *stub = userdata;
+	HTTPStubClient *client;
+	gint fd;
+
+	while ((fd = accept(stub->fd, NULL, NULL)) >= 0 || errno == EINTR || errno == ECONNABORTED)
+	{
+		if (fd < 0)
+			continue;
+
+		if (g_atomic_int_get(&stub->stopping))
+		{
+			close(fd);
+			break;
+		}
+
+		client = g_new0(HTTPStubClient, 1);
+		client->stub = stub;
+		client->fd = fd;
+
+		g_mutex_lock(stub->lock);
+		stub->clients++;
+		g_mutex_unlock(stub->lock);
+
+		g_thread_create(httpstub_client, client, FALSE, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts a server on an ephemeral port of 127.0.0.1, answering every
+ * connection from its own thread.
+ */
+HTTPStub *
+httpstub_new(void)
+{
+	HTTPStub *stub;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof addr;
+
+	stub = g_new0(HTTPStub, 1);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((stub->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(stub->fd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+	    listen(stub->fd, 64) < 0 ||
+	    getsockname(stub->fd, (struct sockaddr *) &addr, &addrlen) < 0)
+	{
+		g_warning("httpstub: %s", g_strerror(errno));
+		if (stub->fd >= 0)
+			close(stub->fd);
+		g_free(stub);
+		return NULL;
+	}
+
+	stub->port = ntohs(addr.sin_port);
+	stub->lock = g_mutex_new();
+	stub->idle = g_cond_new();
+	stub->hits = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	stub->thread = g_thread_create(httpstub_accept, stub, TRUE, NULL);
+
+	return stub;
+}
+
+/*
+ * Stops accepting, cuts short any delays still running and waits for the
+ * client threads to finish.
+ */
+void
+httpstub_free(HTTPStub *stub)
+{
+	g_atomic_int_set(&stub->stopping, TRUE);
+
+	shutdown(stub->fd, SHUT_RDWR);
+	g_thread_join(stub->thread);
+	close(stub->fd);
+
+	g_mutex_lock(stub->lock);
+	while (stub->clients > 0)
+		g_cond_wait(stub->idle, stub->lock);
+	g_mutex_unlock(stub->lock);
+
+	g_hash_table_destroy(stub->hits);
+	g_cond_free(stub->idle);
+	g_mutex_free(stub->lock);
+	g_free(stub);
+}
+
+gchar *
+httpstub_url(HTTPStub *stub, const gchar *path)
+{
+	return g_strdup_printf("http://127.0.0.1:%u%s", stub->port, path);
+}
+
+/*
+ * Returns how many requests were made for path; /once/TAG/... paths are
+ * counted under /once/TAG.
+ */
+guint
+httpstub_hits(HTTPStub *stub, const gchar *path)
+{
+	guint hits;
+
+	g_mutex_lock(stub->lock);
+	hits = GPOINTER_TO_UINT(g_hash_table_lookup(stub->hits, path));
+	g_mutex_unlock(stub->lock);
+
+	return hits;
+}
@@ -0,0 +1,56 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * httpstub.h: scripted HTTP server on the loopback interface.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+
+#ifndef __HTTPSTUB_H__
+#define __HTTPSTUB_H__
+
+/*
+ * The path of a request is its script:
+ *
+ *   /ok/N              200 with an N byte body
+ *   /missing           404
+ *   /redirect/N        302 to /ok/N
+ *   /chunked/N         200 with an N byte body in chunked encoding
+ *   /stall/MS/N        waits MS milliseconds before answering like /ok/N
+ *   /slow/MS/N         answers like /ok/N, but sends 1 KiB every MS
+ *                      milliseconds
+ *   /reset/N           announces N bytes, sends half and resets the
+ *                      connection
+ *   /once/TAG/...      behaves like the rest of the path on the first hit
+ *                      and without any delay on later ones
+ *
+ * Bodies are HTTPSTUB_BYTE(0), HTTPSTUB_BYTE(1), ... so that downloads can
+ * be checked byte for byte.  Every connection is closed after one response.
+ */
+#define HTTPSTUB_BYTE(i)	((gchar) ('a' + (i) % 26))
+
+typedef struct _HTTPStub HTTPStub;
+
+HTTPStub *httpstub_new(void);
+void httpstub_free(HTTPStub *stub);
+gchar *httpstub_url(HTTPStub *stub, const gchar *path);
+guint httpstub_hits(HTTPStub *stub, const gchar *path);
+
+#endif
@@ -0,0 +1,450 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * pipeline.c: the staged download pipeline against the stub server.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "amzdownload.h"
+#include "amztest.h"
+
+/* small enough that every queue fills up behind the stalled tracks. */
+#define PIPELINE_DEPTH		2
+
+static const gchar *transports[] = { "soup", "curl", NULL };
+
+/*
+ * Each route is used once, so a track is known by its url.  A file
+ * without routes and not broken is an empty playlist; a missing file is
+ * never written at all.
+ */
+typedef struct {
+	const gchar *name;
+	const gchar *routes[5];
+	guint failures;
+	bool broken;
+	bool missing;
+} PipelineFile;
+
+static const PipelineFile files[] = {
+	{ "stalled.amz", { "/stall/300/10000", "/stall/300/10001", "/ok/10002", "/ok/10003", NULL }, 0 },
+	{ "empty.amz", { NULL }, 0 },
+	{ "mixed.amz", { "/ok/20000", "/missing", "/redirect/20002", "/chunked/20003", NULL }, 1 },
+	{ "broken.amz", { NULL }, 1, true },
+	{ "missing.amz", { NULL }, 1, false, true },
+	{ "last.amz", { "/stall/100/30000", "/ok/30001", NULL }, 0 },
+};
+
+static const PipelineFile cancelled_files[] = {
+	{ "first.amz", { "/slow/20/400000", "/slow/20/400001", "/slow/20/400002", NULL } },
+	{ "second.amz", { "/slow/20/400003", "/slow/20/400004", "/slow/20/400005", NULL } },
+};
+
+/* what came back for one file. */
+typedef struct {
+	guint results;
+	guint tracks;
+	guint failures;
+	guint done;
+	guint file_tracks;
+	guint file_failures;
+	bool late;
+} PipelineFileResults;
+
+typedef struct {
+	AMZTestEnv *env;
+	AMZPipeline *pipeline;
+	GHashTable *urls;
+	GHashTable *files;
+	guint succeeded;
+	guint cancelled;
+	bool stray;
+
+	/* written by the watcher thread, read once it is joined. */
+	gint stop;
+	guint polls;
+	bool overfull;
+	bool overbusy;
+} PipelineRun;
+
+static gchar *
+pipeline_path(AMZPlaylistEntry *entry, gpointer userdata)
+{
+	PipelineRun *run = userdata;
+
+	return amztest_path(run->env, entry->title);
+}
+
+/* called from the finalize stage only, so nothing here needs a lock. */
+static void
+pipeline_finished(const AMZPipelineResult *result, gpointer userdata)
+{
+	PipelineRun *run = userdata;
+	PipelineFileResults *file;
+	guint count;
+
+	if ((file = g_hash_table_lookup(run->files, result->file)) == NULL)
+	{
+		run->stray = true;
+		return;
+	}
+
+	if (file->done)
+		file->late = true;
+
+	file->results++;
+
+	if (result->url != NULL)
+	{
+		count = GPOINTER_TO_UINT(g_hash_table_lookup(run->urls, result->url));
+		g_hash_table_insert(run->urls, g_strdup(result->url), GUINT_TO_POINTER(count + 1));
+
+		file->tracks++;
+		if (result->success)
+			run->succeeded++;
+		else
+			file->failures++;
+		if (result->cancelled)
+			run->cancelled++;
+	}
+	else if (!result->success)
+		file->failures++;
+
+	if (result->file_done)
+	{
+		file->done++;
+		file->file_tracks = result->file_tracks;
+		file->file_failures = result->file_failures;
+	}
+}
+
+/* samples the queues for as long as the pipeline runs. */
+static gpointer
+pipeline_watch(gpointer userdata)
+{
+	PipelineRun *run = userdata;
+	AMZPipelineStageStats stats[8];
+	guint i, n;
+
+	while (!g_atomic_int_get(&run->stop))
+	{
+		n = amzpipeline_get_stats(run->pipeline, stats, G_N_ELEMENTS(stats));
+
+		for (i = 0; i < n; i++)
+		{
+			if (stats[i].depth > stats[i].capacity)
+				run->overfull = true;
+			if (!strcmp(stats[i].name, "download") && stats[i].busy > PIPELINE_DEPTH)
+				run->overbusy = true;
+		}
+
+		run->polls++;
+		g_usleep(1000);
+	}
+
+	return NULL;
+}
+
+static guint
+pipeline_tracks(const PipelineFile *spec)
+{
+	guint n;
+
+	for (n = 0; spec->routes[n] != NULL; n++)
+		;
+
+	return n;
+}
+
+static gchar *
+pipeline_document(AMZTestEnv *env, const PipelineFile *spec)
+{
+	GString *doc;
+	gchar *url;
+	guint i;
+
+	if (spec->broken)
+		return g_strdup("this is not xml\n");
+
+	doc = g_string_new("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			   "<playlist version=\"1\" xmlns=\"http://xspf.org/ns/0/\"><trackList>\n");
+
+	for (i = 0; spec->routes[i] != NULL; i++)
+	{
+		url = httpstub_url(env->stub, spec->routes[i]);
+		g_string_append_printf(doc, "<track><location>%s</location><creator>Creator</creator>"
+				       "<album>Album</album><title>%.*s-%u</title><trackNum>%u</trackNum></track>\n",
+				       url, (gint) (strlen(spec->name) - 4), spec->name, i + 1, i + 1);
+		g_free(url);
+	}
+
+	g_string_append(doc, "</trackList></playlist>\n");
+
+	return g_string_free(doc, FALSE);
+}
+
+static void
+pipeline_run_begin(PipelineRun *run, AMZTestEnv *env, const PipelineFile *specs, guint n)
+{
+	guint i;
+
+	memset(run, 0, sizeof *run);
+	run->env = env;
+	run->urls = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	run->files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	for (i = 0; i < n; i++)
+		g_hash_table_insert(run->files, amztest_path(env, specs[i].name), g_new0(PipelineFileResults, 1));
+}
+
+static void
+pipeline_run_end(PipelineRun *run)
+{
+	g_hash_table_destroy(run->urls);
+	g_hash_table_destroy(run->files);
+}
+
+/* writes out the .amz files and pushes them all, returning with the pipeline started. */
+static bool
+pipeline_start(PipelineRun *run, AMZDownloadSession *session, const PipelineFile *specs, guint n,
+	       GThread **watcher)
+{
+	gchar *path, *doc, *amz;
+	guint i;
+
+	run->pipeline = amzpipeline_new(session, PIPELINE_DEPTH, pipeline_path, pipeline_finished, run);
+	if (!amzpipeline_start(run->pipeline))
+	{
+		amzpipeline_free(run->pipeline);
+		return false;
+	}
+
+	*watcher = g_thread_create(pipeline_watch, run, TRUE, NULL);
+
+	for (i = 0; i < n; i++)
+	{
+		path = amztest_path(run->env, specs[i].name);
+
+		if (!specs[i].missing)
+		{
+			doc = pipeline_document(run->env, &specs[i]);
+			amz = amztest_encode_amz(doc);
+			g_file_set_contents(path, amz, -1, NULL);
+			g_free(amz);
+			g_free(doc);
+		}
+
+		amzpipeline_push_file(run->pipeline, path);
+		g_free(path);
+	}
+
+	return true;
+}
+
+static void
+pipeline_finish(PipelineRun *run, GThread *watcher)
+{
+	amzpipeline_close(run->pipeline);
+	amzpipeline_join(run->pipeline);
+
+	g_atomic_int_set(&run->stop, TRUE);
+	g_thread_join(watcher);
+
+	amzpipeline_free(run->pipeline);
+	run->pipeline = NULL;
+}
+
+/*
+ * The checks that hold however a run ended: a single url-less failure
+ * for a file that never got as far as its tracks, otherwise one result
+ * per track with the file's totals on the last one.
+ */
+static void
+pipeline_check_files(AMZTestEnv *env, PipelineRun *run, const PipelineFile *specs, guint n)
+{
+	PipelineFileResults *file;
+	gchar *path, *url;
+	guint i, j;
+
+	AMZTEST_CHECK(env, !run->stray);
+
+	for (i = 0; i < n; i++)
+	{
+		path = amztest_path(env, specs[i].name);
+		file = g_hash_table_lookup(run->files, path);
+		g_free(path);
+
+		AMZTEST_CHECK(env, file->done == 1 && !file->late);
+		AMZTEST_CHECK(env, file->file_tracks == file->tracks);
+		AMZTEST_CHECK(env, file->file_failures == file->failures);
+
+		if (file->tracks == 0 && file->failures == 1)
+		{
+			AMZTEST_CHECK(env, file->results == 1);
+			continue;
+		}
+
+		/* every route came back exactly once, plus a url-less result if it finished parsing last. */
+		AMZTEST_CHECK(env, file->results == file->tracks || file->results == file->tracks + 1);
+
+		AMZTEST_CHECK(env, file->tracks == pipeline_tracks(&specs[i]));
+
+		for (j = 0; specs[i].routes[j] != NULL; j++)
+		{
+			url = httpstub_url(env->stub, specs[i].routes[j]);
+			AMZTEST_CHECK(env, GPOINTER_TO_UINT(g_hash_table_lookup(run->urls, url)) == 1);
+			g_free(url);
+		}
+	}
+}
+
+static void
+test_files(AMZTestEnv *env)
+{
+	AMZDownloadSession *session;
+	PipelineFileResults *file;
+	PipelineRun run;
+	GThread *watcher;
+	gchar *path;
+	guint i;
+
+	session = amzdownload_session_new_with_transport(env->transport);
+	pipeline_run_begin(&run, env, files, G_N_ELEMENTS(files));
+
+	AMZTEST_CHECK(env, pipeline_start(&run, session, files, G_N_ELEMENTS(files), &watcher));
+	pipeline_finish(&run, watcher);
+	amzdownload_session_free(session);
+
+	AMZTEST_CHECK(env, run.polls > 0);
+	AMZTEST_CHECK(env, !run.overfull);
+	AMZTEST_CHECK(env, !run.overbusy);
+	AMZTEST_CHECK(env, run.cancelled == 0);
+
+	pipeline_check_files(env, &run, files, G_N_ELEMENTS(files));
+	if (env->failed)
+	{
+		pipeline_run_end(&run);
+		return;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(files); i++)
+	{
+		path = amztest_path(env, files[i].name);
+		file = g_hash_table_lookup(run.files, path);
+		g_free(path);
+
+		if (file->file_tracks != pipeline_tracks(&files[i]) || file->file_failures != files[i].failures)
+		{
+			fprintf(stderr, "    %s: %u tracks, %u failures\n", files[i].name,
+				file->file_tracks, file->file_failures);
+			env->failed = true;
+		}
+	}
+
+	pipeline_run_end(&run);
+
+	AMZTEST_CHECK(env, amztest_file_matches((path = amztest_path(env, "stalled-2")), 10001));
+	g_free(path);
+	AMZTEST_CHECK(env, amztest_file_matches((path = amztest_path(env, "mixed-4")), 20003));
+	g_free(path);
+	AMZTEST_CHECK(env, !g_file_test((path = amztest_path(env, "mixed-2")), G_FILE_TEST_EXISTS));
+	g_free(path);
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+}
+
+static void
+test_cancel(AMZTestEnv *env)
+{
+	AMZDownloadSession *session;
+	PipelineRun run;
+	GThread *watcher;
+	guint i;
+
+	session = amzdownload_session_new_with_transport(env->transport);
+	pipeline_run_begin(&run, env, cancelled_files, G_N_ELEMENTS(cancelled_files));
+
+	AMZTEST_CHECK(env, pipeline_start(&run, session, cancelled_files, G_N_ELEMENTS(cancelled_files), &watcher));
+
+	/* the slow routes take seconds; cancel once they are writing. */
+	for (i = 0; i < 500 && amztest_count_partials(env) < PIPELINE_DEPTH; i++)
+		g_usleep(10000);
+
+	amzpipeline_cancel(run.pipeline);
+	pipeline_finish(&run, watcher);
+	amzdownload_session_free(session);
+
+	AMZTEST_CHECK(env, i < 500);
+	AMZTEST_CHECK(env, !run.overfull);
+	AMZTEST_CHECK(env, !run.overbusy);
+
+	pipeline_check_files(env, &run, cancelled_files, G_N_ELEMENTS(cancelled_files));
+
+	/* nothing could have finished, so every track came back cancelled. */
+	AMZTEST_CHECK(env, run.succeeded == 0);
+	AMZTEST_CHECK(env, run.cancelled == g_hash_table_size(run.urls));
+
+	pipeline_run_end(&run);
+
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+}
+
+static const struct {
+	const gchar *name;
+	AMZTestFunc func;
+} tests[] = {
+	{ "files", test_files },
+	{ "cancel", test_cancel },
+};
+
+void
+pipeline_tests(AMZTestEnv *env)
+{
+	AMZDownloadSession *session;
+	gchar *name;
+	guint i, j;
+
+	for (i = 0; transports[i] != NULL; i++)
+	{
+		env->transport = transports[i];
+
+		if ((session = amzdownload_session_new_with_transport(env->transport)) == NULL)
+		{
+			printf("SKIP pipeline/%s: not available\n", env->transport);
+			continue;
+		}
+
+		amzdownload_session_free(session);
+
+		for (j = 0; j < G_N_ELEMENTS(tests); j++)
+		{
+			name = g_strdup_printf("pipeline/%s/%s", env->transport, tests[j].name);
+			amztest_run(env, name, tests[j].func);
+			g_free(name);
+		}
+	}
+
+	env->transport = NULL;
+}
@@ -0,0 +1,284 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * playlist.c: XSPF parsing and the track filter language.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libamz.h"
+#include "amztest.h"
+
+#define TRACKTYPE	"http://www.amazon.com/dmusic/trackType"
+#define DISCNUM		"http://www.amazon.com/dmusic/discNum"
+
+/*
+ * Two main trackLists with a deluxe one between them.  Gamma has no
+ * trackNum, duration or meta at all, so the filter falls back to its
+ * defaults for it; the deluxe and last tracks have no creator.
+ */
+static const gchar xspf[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<playlist version=\"1\" xmlns=\"http://xspf.org/ns/0/\">\n"
+	"<trackList>\n"
+	"<track><title>Alpha</title><creator>Björk</creator><album>Post</album>"
+	"<trackNum>1</trackNum><duration>100</duration>"
+	"<meta rel=\"" TRACKTYPE "\">mp3</meta><meta rel=\"" DISCNUM "\">1</meta></track>\n"
+	"<track><title>Beta</title><creator>BJÖRK</creator><album>Post</album>"
+	"<trackNum>2</trackNum><duration>200</duration>"
+	"<meta rel=\"" TRACKTYPE "\">flac</meta><meta rel=\"" DISCNUM "\">2</meta></track>\n"
+	"<track><title>Gamma Live</title><creator>Other</creator><album>Live</album></track>\n"
+	"</trackList>\n"
+	"<extension application=\"http://www.amazon.com/dmusic/\"><deluxe><trackList>\n"
+	"<track><title>Delta</title><trackNum>3</trackNum>"
+	"<meta rel=\"" TRACKTYPE "\">mp3</meta><meta rel=\"" DISCNUM "\">2</meta></track>\n"
+	"<track><title>Epsilon (Live)</title><trackNum>10</trackNum></track>\n"
+	"</trackList></deluxe></extension>\n"
+	"<trackList>\n"
+	"<track><title>Zeta</title><trackNum>12</trackNum></track>\n"
+	"</trackList>\n"
+	"</playlist>\n";
+
+static const struct {
+	const gchar *expr;
+	const gchar *titles;
+} filters[] = {
+	/* no filter at all: document order across all three trackLists. */
+	{ NULL, "Alpha,Beta,Gamma Live,Delta,Epsilon (Live),Zeta" },
+
+	/* = and != ignore case, for non-ASCII letters too. */
+	{ "title=alpha", "Alpha" },
+	{ "title=ALPHA,beta", "Alpha,Beta" },
+	{ "creator=björk", "Alpha,Beta" },
+	{ "creator!=BJÖRK", "Gamma Live,Delta,Epsilon (Live),Zeta" },
+	{ "'title=gamma live'", "Gamma Live" },
+
+	/* ~ and !~ are globs, and ignore case the same way. */
+	{ "title~*live*", "Gamma Live,Epsilon (Live)" },
+	{ "title!~*LIVE*", "Alpha,Beta,Delta,Zeta" },
+	{ "creator~bjö*", "Alpha,Beta" },
+	{ "title~?eta", "Beta,Zeta" },
+
+	/* numeric comparisons; a missing trackNum counts as 0. */
+	{ "tracknum<2", "Alpha,Gamma Live" },
+	{ "tracknum<=2", "Alpha,Beta,Gamma Live" },
+	{ "tracknum>3", "Epsilon (Live),Zeta" },
+	{ "tracknum>=3", "Delta,Epsilon (Live),Zeta" },
+	{ "tracknum=0", "Gamma Live" },
+	{ "tracknum!=1,2,0", "Delta,Epsilon (Live),Zeta" },
+	{ "duration>=200", "Beta" },
+	{ "duration=0", "Gamma Live,Delta,Epsilon (Live),Zeta" },
+
+	/* missing meta falls back to type mp3 on disc 1. */
+	{ "type=mp3", "Alpha,Gamma Live,Delta,Epsilon (Live),Zeta" },
+	{ "type=FLAC", "Beta" },
+	{ "disc=2", "Beta,Delta" },
+	{ "disc=1", "Alpha,Gamma Live,Epsilon (Live),Zeta" },
+
+	/* deluxe picks a kind of trackList, skipping the other entirely. */
+	{ "deluxe=1", "Delta,Epsilon (Live)" },
+	{ "deluxe=0", "Alpha,Beta,Gamma Live,Zeta" },
+	{ "deluxe!=0 tracknum>3", "Epsilon (Live)" },
+	{ "deluxe>1", "" },
+
+	/* every clause must hold. */
+	{ "album=post type=flac", "Beta" },
+	{ "album=post type=flac disc=1", "" },
+};
+
+static const gchar *bad_filters[] = {
+	"bogus=1",
+	"title",
+	"title<3",
+	"tracknum=abc",
+	"tracknum<",
+	"tracknum<2x",
+	"disc=",
+	"type=",
+	"type=mp3,,flac",
+	"title=a,",
+	"deluxe=",
+};
+
+/* returns the titles of the tracks that pass expr (if any), comma-separated. */
+static gchar *
+filtered_titles(const gchar *expr, GError **error)
+{
+	AMZPlaylistFilter *filter = NULL;
+	GList *list, *node;
+	GString *out;
+
+	if (expr != NULL && (filter = amzplaylist_filter_new(expr, error)) == NULL)
+		return NULL;
+
+	out = g_string_new(NULL);
+
+	if (!amzplaylist_parse_filtered((const guchar *) xspf, filter, &list))
+		g_string_append(out, "(parse failed)");
+
+	for (node = list; node != NULL; node = node->next)
+	{
+		AMZPlaylistEntry *entry = node->data;
+
+		if (node != list)
+			g_string_append_c(out, ',');
+		g_string_append(out, entry->title);
+	}
+
+	if (list != NULL)
+		amzplaylist_free(list);
+	if (filter != NULL)
+		amzplaylist_filter_free(filter);
+
+	return g_string_free(out, FALSE);
+}
+
+static void
+test_filters(AMZTestEnv *env)
+{
+	GError *error = NULL;
+	gchar *titles;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(filters); i++)
+	{
+		titles = filtered_titles(filters[i].expr, &error);
+
+		if (titles == NULL)
+		{
+			fprintf(stderr, "    filter \"%s\": %s\n", filters[i].expr, error->message);
+			g_error_free(error);
+			error = NULL;
+			env->failed = true;
+			continue;
+		}
+
+		if (strcmp(titles, filters[i].titles))
+		{
+			fprintf(stderr, "    filter \"%s\": got \"%s\", expected \"%s\"\n",
+				filters[i].expr, titles, filters[i].titles);
+			env->failed = true;
+		}
+
+		g_free(titles);
+	}
+}
+
+static void
+test_bad_filters(AMZTestEnv *env)
+{
+	AMZPlaylistFilter *filter;
+	GError *error = NULL;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(bad_filters); i++)
+	{
+		filter = amzplaylist_filter_new(bad_filters[i], &error);
+
+		if (filter != NULL)
+		{
+			fprintf(stderr, "    filter \"%s\" was accepted\n", bad_filters[i]);
+			amzplaylist_filter_free(filter);
+			env->failed = true;
+		}
+		else if (error == NULL || error->domain != AMZPLAYLIST_FILTER_ERROR ||
+			 error->code != AMZPLAYLIST_FILTER_ERROR_PARSE)
+		{
+			fprintf(stderr, "    filter \"%s\" failed without a parse error\n", bad_filters[i]);
+			env->failed = true;
+		}
+
+		if (error != NULL)
+			g_error_free(error);
+		error = NULL;
+	}
+
+	/* quoting errors come from the shell parser instead. */
+	AMZTEST_CHECK(env, amzplaylist_filter_new("'title=unterminated", &error) == NULL && error != NULL);
+	g_error_free(error);
+}
+
+/* entries themselves leave missing numbers at 0 and missing meta unset. */
+static void
+test_entries(AMZTestEnv *env)
+{
+	AMZPlaylistEntry *alpha, *gamma;
+	GList *list;
+
+	AMZTEST_CHECK(env, amzplaylist_parse_filtered((const guchar *) xspf, NULL, &list));
+	AMZTEST_CHECK(env, g_list_length(list) == 6);
+
+	alpha = g_list_nth_data(list, 0);
+	gamma = g_list_nth_data(list, 2);
+
+	AMZTEST_CHECK(env, alpha->tracknum == 1 && alpha->duration == 100);
+	AMZTEST_CHECK(env, !strcmp(alpha->creator, "Björk") && !strcmp(alpha->album, "Post"));
+	AMZTEST_CHECK(env, alpha->meta != NULL && !strcmp(g_hash_table_lookup(alpha->meta, TRACKTYPE), "mp3"));
+	AMZTEST_CHECK(env, gamma->tracknum == 0 && gamma->duration == 0 && gamma->meta == NULL);
+	AMZTEST_CHECK(env, gamma->location == NULL);
+
+	amzplaylist_free(list);
+}
+
+static void
+test_documents(AMZTestEnv *env)
+{
+	GList *list;
+
+	AMZTEST_CHECK(env, amzplaylist_parse_filtered((const guchar *)
+		"<?xml version=\"1.0\"?><playlist xmlns=\"http://xspf.org/ns/0/\"><trackList/></playlist>",
+		NULL, &list));
+	AMZTEST_CHECK(env, list == NULL);
+
+	AMZTEST_CHECK(env, !amzplaylist_parse_filtered((const guchar *) "this is not xml", NULL, &list));
+	AMZTEST_CHECK(env, list == NULL);
+
+	AMZTEST_CHECK(env, !amzplaylist_parse_filtered((const guchar *) "<?xml version=\"1.0\"?><html/>", NULL, &list));
+	AMZTEST_CHECK(env, list == NULL);
+}
+
+static const struct {
+	const gchar *name;
+	AMZTestFunc func;
+} tests[] = {
+	{ "filters", test_filters },
+	{ "bad-filters", test_bad_filters },
+	{ "entries", test_entries },
+	{ "documents", test_documents },
+};
+
+void
+playlist_tests(AMZTestEnv *env)
+{
+	gchar *name;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(tests); i++)
+	{
+		name = g_strdup_printf("playlist/%s", tests[i].name);
+		amztest_run(env, name, tests[i].func);
+		g_free(name);
+	}
+}
@@ -0,0 +1,547 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * tag.c: inline ID3v2 and FLAC tagging of downloaded streams.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "amzdownload.h"
+#include "amztest.h"
+
+/*
+ * Every case builds an input stream and the exact output expected for it,
+ * written out from the ID3v2 and FLAC specifications rather than with the
+ * writer's own helpers.  The input is then fed through the writer split
+ * in two at every possible offset, and one byte at a time.
+ */
+typedef struct {
+	const gchar *name;
+	void (*build)(GByteArray *in, GByteArray *expected);
+} TagCase;
+
+/* large enough that a syncsafe size differs from a plain one. */
+#define KEPT_LEN	200
+
+static void
+put(GByteArray *out, const void *data, gsize len)
+{
+	g_byte_array_append(out, data, len);
+}
+
+static void
+put_str(GByteArray *out, const gchar *str)
+{
+	put(out, str, strlen(str));
+}
+
+static void
+put_be24(GByteArray *out, guint32 v)
+{
+	guint8 b[3] = { v >> 16, v >> 8, v };
+
+	put(out, b, sizeof b);
+}
+
+static void
+put_be32(GByteArray *out, guint32 v)
+{
+	guint8 b[4] = { v >> 24, v >> 16, v >> 8, v };
+
+	put(out, b, sizeof b);
+}
+
+static void
+put_le32(GByteArray *out, guint32 v)
+{
+	guint8 b[4] = { v, v >> 8, v >> 16, v >> 24 };
+
+	put(out, b, sizeof b);
+}
+
+static void
+put_syncsafe(GByteArray *out, guint32 v)
+{
+	guint8 b[4] = { (v >> 21) & 0x7f, (v >> 14) & 0x7f, (v >> 7) & 0x7f, v & 0x7f };
+
+	put(out, b, sizeof b);
+}
+
+/* a few MPEG frames' worth of audio, starting with a frame sync. */
+static void
+put_mpeg(GByteArray *out)
+{
+	static const guint8 sync[4] = { 0xff, 0xfb, 0x90, 0x64 };
+	guint i;
+
+	put(out, sync, sizeof sync);
+	for (i = 0; i < 300; i++)
+	{
+		guint8 b = i * 7;
+		put(out, &b, 1);
+	}
+}
+
+static void
+id3_header(GByteArray *out, guint version, guint8 flags, guint32 size)
+{
+	guint8 b[6] = { 'I', 'D', '3', version, 0, flags };
+
+	put(out, b, sizeof b);
+	put_syncsafe(out, size);
+}
+
+static void
+id3_frame(GByteArray *out, guint version, const gchar *id, guint16 flags, const guint8 *data, gsize len)
+{
+	guint8 f[2] = { flags >> 8, flags };
+
+	put(out, id, 4);
+	if (version == 3)
+		put_be32(out, len);
+	else
+		put_syncsafe(out, len);
+	put(out, f, sizeof f);
+	put(out, data, len);
+}
+
+/* ID3v2.3 text is UTF-16 with a BOM; ASCII is all these tests need. */
+static void
+id3_text(GByteArray *out, guint version, const gchar *id, const gchar *text)
+{
+	GByteArray *data = g_byte_array_new();
+	guint8 zero = 0;
+	gsize i;
+
+	if (version == 3)
+	{
+		put(data, "\x01\xff\xfe", 3);
+		for (i = 0; text[i] != '\0'; i++)
+		{
+			put(data, text + i, 1);
+			put(data, &zero, 1);
+		}
+	}
+	else
+	{
+		put(data, "\x03", 1);
+		put_str(data, text);
+	}
+
+	id3_frame(out, version, id, 0, data->data, data->len);
+	g_byte_array_free(data, TRUE);
+}
+
+static void
+id3_kept(GByteArray *out, guint version, const gchar *id)
+{
+	guint8 data[KEPT_LEN];
+	guint i;
+
+	for (i = 0; i < sizeof data; i++)
+		data[i] = i;
+
+	id3_frame(out, version, id, 0, data, sizeof data);
+}
+
+/* our frames, as written for the test's tag. */
+static void
+id3_ours(GByteArray *out, guint version)
+{
+	id3_text(out, version, "TIT2", "Title");
+	id3_text(out, version, "TPE1", "Artist");
+	id3_text(out, version, "TALB", "Album");
+	id3_text(out, version, "TRCK", "7");
+}
+
+/* a complete tag: header, then frames. */
+static void
+id3_tag(GByteArray *out, guint version, guint8 flags, GByteArray *frames)
+{
+	id3_header(out, version, flags, frames->len);
+	put(out, frames->data, frames->len);
+}
+
+static void
+build_untagged_mpeg(GByteArray *in, GByteArray *expected)
+{
+	GByteArray *frames = g_byte_array_new();
+
+	put_mpeg(in);
+
+	id3_ours(frames, 4);
+	id3_tag(expected, 4, 0, frames);
+	put_mpeg(expected);
+
+	g_byte_array_free(frames, TRUE);
+}
+
+/*
+ * An ID3v2.3 tag stays at 2.3, with plain frame sizes.  Our frames replace
+ * its own, frames marked for discarding or transformed are dropped, and
+ * the padding goes.
+ */
+static void
+build_id3v23_merge(GByteArray *in, GByteArray *expected)
+{
+	GByteArray *frames = g_byte_array_new();
+	static const guint8 padding[20] = { 0 };
+
+	id3_text(frames, 3, "TIT2", "Old title");
+	id3_kept(frames, 3, "PRIV");
+	id3_text(frames, 3, "TPE1", "Old artist");
+	id3_frame(frames, 3, "TXXX", 0x8000, (const guint8 *) "\0discard", 8);
+	id3_frame(frames, 3, "APIC", 0x0080, (const guint8 *) "compressed", 10);
+	id3_text(frames, 3, "TCON", "Jazz");
+	put(frames, padding, sizeof padding);
+	id3_tag(in, 3, 0, frames);
+	put_mpeg(in);
+
+	g_byte_array_set_size(frames, 0);
+	id3_ours(frames, 3);
+	id3_kept(frames, 3, "PRIV");
+	id3_text(frames, 3, "TCON", "Jazz");
+	id3_tag(expected, 3, 0, frames);
+	put_mpeg(expected);
+
+	g_byte_array_free(frames, TRUE);
+}
+
+/* an ID3v2.4 tag with a footer is merged, and the footer does not leak into the audio. */
+static void
+build_id3v24_footer(GByteArray *in, GByteArray *expected)
+{
+	GByteArray *frames = g_byte_array_new();
+
+	id3_text(frames, 4, "TALB", "Old album");
+	id3_kept(frames, 4, "PRIV");
+	id3_frame(frames, 4, "TXXX", 0x4000, (const guint8 *) "\3discard", 8);
+	id3_frame(frames, 4, "APIC", 0x0004, (const guint8 *) "encrypted", 9);
+	id3_text(frames, 4, "TCON", "Rock");
+	id3_tag(in, 4, 0x10, frames);
+	put_str(in, "3DI");
+	put(in, "\x04\x00\x10", 3);
+	put_syncsafe(in, frames->len);
+	put_mpeg(in);
+
+	g_byte_array_set_size(frames, 0);
+	id3_ours(frames, 4);
+	id3_kept(frames, 4, "PRIV");
+	id3_text(frames, 4, "TCON", "Rock");
+	id3_tag(expected, 4, 0, frames);
+	put_mpeg(expected);
+
+	g_byte_array_free(frames, TRUE);
+}
+
+/* an unsynchronised tag cannot be merged safely, so it is replaced. */
+static void
+build_id3_unsync(GByteArray *in, GByteArray *expected)
+{
+	GByteArray *frames = g_byte_array_new();
+
+	id3_text(frames, 4, "TCON", "Rock");
+	id3_kept(frames, 4, "PRIV");
+	id3_tag(in, 4, 0x80, frames);
+	put_mpeg(in);
+
+	g_byte_array_set_size(frames, 0);
+	id3_ours(frames, 4);
+	id3_tag(expected, 4, 0, frames);
+	put_mpeg(expected);
+
+	g_byte_array_free(frames, TRUE);
+}
+
+/* ID3v2.2, with its three-letter frame ids, is replaced by a v2.4 tag. */
+static void
+build_id3v22(GByteArray *in, GByteArray *expected)
+{
+	GByteArray *frames = g_byte_array_new();
+
+	put(frames, "TT2\x00\x00\x06\x00Title", 12);
+	put(frames, "TCO\x00\x00\x05\x00Rock", 11);
+	id3_tag(in, 2, 0, frames);
+	put_mpeg(in);
+
+	g_byte_array_set_size(frames, 0);
+	id3_ours(frames, 4);
+	id3_tag(expected, 4, 0, frames);
+	put_mpeg(expected);
+
+	g_byte_array_free(frames, TRUE);
+}
+
+static void
+flac_block(GByteArray *out, guint8 type, bool last, GByteArray *data)
+{
+	guint8 b = type | (last ? 0x80 : 0);
+
+	put(out, &b, 1);
+	put_be24(out, data->len);
+	put(out, data->data, data->len);
+}
+
+static void
+flac_filler(GByteArray *out, guint8 type, bool last, gsize len)
+{
+	GByteArray *data = g_byte_array_new();
+	guint8 b;
+	gsize i;
+
+	for (i = 0; i < len; i++)
+	{
+		b = type * 16 + i;
+		put(data, &b, 1);
+	}
+
+	flac_block(out, type, last, data);
+	g_byte_array_free(data, TRUE);
+}
+
+static void
+flac_comments(GByteArray *out, bool last, const gchar *vendor, const gchar **comments)
+{
+	GByteArray *data = g_byte_array_new();
+	guint i;
+
+	put_le32(data, strlen(vendor));
+	put_str(data, vendor);
+	put_le32(data, g_strv_length((gchar **) comments));
+	for (i = 0; comments[i] != NULL; i++)
+	{
+		put_le32(data, strlen(comments[i]));
+		put_str(data, comments[i]);
+	}
+
+	flac_block(out, 4, last, data);
+	g_byte_array_free(data, TRUE);
+}
+
+static void
+put_flac_audio(GByteArray *out)
+{
+	static const guint8 sync[2] = { 0xff, 0xf8 };
+	guint i;
+
+	put(out, sync, sizeof sync);
+	for (i = 0; i < 200; i++)
+	{
+		guint8 b = i * 13;
+		put(out, &b, 1);
+	}
+}
+
+/* STREAMINFO, then padding marked last; our comment block must end up last. */
+static void
+build_flac_without_comment(GByteArray *in, GByteArray *expected)
+{
+	static const gchar *ours[] = { "TITLE=Title", "ARTIST=Artist", "ALBUM=Album", "TRACKNUMBER=7", NULL };
+
+	put_str(in, "fLaC");
+	flac_filler(in, 0, false, 34);
+	flac_filler(in, 1, true, 10);
+	put_flac_audio(in);
+
+	put_str(expected, "fLaC");
+	flac_filler(expected, 0, false, 34);
+	flac_filler(expected, 1, false, 10);
+	flac_comments(expected, true, "libamz", ours);
+	put_flac_audio(expected);
+}
+
+/*
+ * An existing comment block in the middle is merged into ours: its TITLE
+ * and tracknumber (in any case) give way, the rest is kept in order.
+ */
+static void
+build_flac_with_comment(GByteArray *in, GByteArray *expected)
+{
+	static const gchar *old[] = { "TITLE=Old", "GENRE=Jazz", "tracknumber=3", "DATE=1999", NULL };
+	static const gchar *merged[] = { "TITLE=Title", "ARTIST=Artist", "ALBUM=Album", "TRACKNUMBER=7",
+					 "GENRE=Jazz", "DATE=1999", NULL };
+
+	put_str(in, "fLaC");
+	flac_filler(in, 0, false, 34);
+	flac_comments(in, false, "reference", old);
+	flac_filler(in, 3, true, 18);
+	put_flac_audio(in);
+
+	put_str(expected, "fLaC");
+	flac_filler(expected, 0, false, 34);
+	flac_filler(expected, 3, false, 18);
+	flac_comments(expected, true, "libamz", merged);
+	put_flac_audio(expected);
+}
+
+/* an existing comment block that was itself last. */
+static void
+build_flac_comment_last(GByteArray *in, GByteArray *expected)
+{
+	static const gchar *old[] = { "ARTIST=Old", "GENRE=Jazz", NULL };
+	static const gchar *merged[] = { "TITLE=Title", "ARTIST=Artist", "ALBUM=Album", "TRACKNUMBER=7",
+					 "GENRE=Jazz", NULL };
+
+	put_str(in, "fLaC");
+	flac_filler(in, 0, false, 34);
+	flac_comments(in, true, "reference", old);
+	put_flac_audio(in);
+
+	put_str(expected, "fLaC");
+	flac_filler(expected, 0, false, 34);
+	flac_comments(expected, true, "libamz", merged);
+	put_flac_audio(expected);
+}
+
+/* formats we do not know are passed through untouched. */
+static void
+build_passthrough(GByteArray *in, GByteArray *expected)
+{
+	put_str(in, "OggS");
+	put_mpeg(in);
+
+	put(expected, in->data, in->len);
+}
+
+/* so are bodies too short to sniff. */
+static void
+build_short(GByteArray *in, GByteArray *expected)
+{
+	put_str(in, "ID");
+
+	put(expected, in->data, in->len);
+}
+
+static const TagCase cases[] = {
+	{ "untagged-mpeg", build_untagged_mpeg },
+	{ "id3v23-merge", build_id3v23_merge },
+	{ "id3v24-footer", build_id3v24_footer },
+	{ "id3-unsync", build_id3_unsync },
+	{ "id3v22", build_id3v22 },
+	{ "flac-without-comment", build_flac_without_comment },
+	{ "flac-with-comment", build_flac_with_comment },
+	{ "flac-comment-last", build_flac_comment_last },
+	{ "passthrough", build_passthrough },
+	{ "short", build_short },
+};
+
+static const TagCase *current;
+
+/* feeds in through a fresh writer in chunks of at most step bytes, after a first chunk of first bytes. */
+static GByteArray *
+run_writer(const AMZTag *tag, GByteArray *in, gsize first, gsize step)
+{
+	AMZTagWriter *writer;
+	GByteArray *out;
+	gsize pos, n;
+
+	writer = amztag_writer_new(tag);
+	out = g_byte_array_new();
+
+	amztag_writer_feed(writer, (const gchar *) in->data, first, out);
+	for (pos = first; pos < in->len; pos += n)
+	{
+		n = MIN(step, in->len - pos);
+		amztag_writer_feed(writer, (const gchar *) in->data + pos, n, out);
+	}
+
+	amztag_writer_finish(writer, out);
+	amztag_writer_free(writer);
+
+	return out;
+}
+
+static bool
+check_output(const gchar *how, gsize at, GByteArray *out, GByteArray *expected)
+{
+	gsize i;
+
+	if (out->len == expected->len && !memcmp(out->data, expected->data, out->len))
+		return true;
+
+	for (i = 0; i < MIN(out->len, expected->len) && out->data[i] == expected->data[i]; i++)
+		;
+
+	fprintf(stderr, "    %s %lu: %u bytes, expected %u; first difference at %lu\n",
+		how, (gulong) at, out->len, expected->len, (gulong) i);
+
+	return false;
+}
+
+static void
+test_case(AMZTestEnv *env)
+{
+	AMZPlaylistEntry entry;
+	AMZTag *tag;
+	GByteArray *in, *expected, *out;
+	gsize split;
+	bool ok;
+
+	memset(&entry, 0, sizeof entry);
+	entry.title = "Title";
+	entry.creator = "Artist";
+	entry.album = "Album";
+	entry.tracknum = 7;
+	tag = amztag_new_from_entry(&entry);
+
+	in = g_byte_array_new();
+	expected = g_byte_array_new();
+	current->build(in, expected);
+
+	/* one split at every offset, reporting only the first failure. */
+	for (split = 0, ok = true; ok && split <= in->len; split++)
+	{
+		out = run_writer(tag, in, split, in->len);
+		ok = check_output("split at", split, out, expected);
+		g_byte_array_free(out, TRUE);
+	}
+
+	AMZTEST_CHECK(env, ok);
+
+	out = run_writer(tag, in, 0, 1);
+	ok = check_output("byte by byte from", 0, out, expected);
+	g_byte_array_free(out, TRUE);
+
+	AMZTEST_CHECK(env, ok);
+
+	g_byte_array_free(expected, TRUE);
+	g_byte_array_free(in, TRUE);
+	amztag_free(tag);
+}
+
+void
+tag_tests(AMZTestEnv *env)
+{
+	gchar *name;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(cases); i++)
+	{
+		name = g_strdup_printf("tag/%s", cases[i].name);
+		current = &cases[i];
+		amztest_run(env, name, test_case);
+		g_free(name);
+	}
+}
@@ -0,0 +1,460 @@
+/*
+ * amztest: regression tests for libamz and its tools.
+ * transport.c: the download engine over each HTTP transport.
+ *
+ * Copyright (c) 2010 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "amzconfig.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "amzdownload.h"
+#include "amztransport.h"
+#include "amztest.h"
+
+static const AMZTransportOps *transports[] = {
+	&amztransport_soup_ops,
+#ifdef HAVE_CURL_MULTI_EPOLL
+	&amztransport_curl_ops,
+#endif
+	NULL
+};
+
+/* downloads route from the stub server into the scratch directory. */
+static bool
+fetch(AMZTestEnv *env, AMZDownloadSession *session, const gchar *route, const gchar *name)
+{
+	gchar *url, *path;
+	bool ret;
+
+	url = httpstub_url(env->stub, route);
+	path = amztest_path(env, name);
+	ret = amzdownload_session_download_url(session, url, path, NULL);
+	g_free(path);
+	g_free(url);
+
+	return ret;
+}
+
+static bool
+exists(AMZTestEnv *env, const gchar *name)
+{
+	gchar *path;
+	bool ret;
+
+	path = amztest_path(env, name);
+	ret = g_file_test(path, G_FILE_TEST_EXISTS);
+	g_free(path);
+
+	return ret;
+}
+
+static bool
+matches(AMZTestEnv *env, const gchar *name, gsize len)
+{
+	gchar *path;
+	bool ret;
+
+	path = amztest_path(env, name);
+	ret = amztest_file_matches(path, len);
+	g_free(path);
+
+	return ret;
+}
+
+static void
+test_ok(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+
+	AMZTEST_CHECK(env, fetch(env, session, "/ok/300000", "ok"));
+	AMZTEST_CHECK(env, matches(env, "ok", 300000));
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+
+	amzdownload_session_free(session);
+}
+
+static void
+test_empty(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+
+	AMZTEST_CHECK(env, fetch(env, session, "/ok/0", "empty"));
+	AMZTEST_CHECK(env, matches(env, "empty", 0));
+
+	amzdownload_session_free(session);
+}
+
+static void
+test_not_found(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+
+	AMZTEST_CHECK(env, !fetch(env, session, "/missing", "missing"));
+	AMZTEST_CHECK(env, !exists(env, "missing"));
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+
+	amzdownload_session_free(session);
+}
+
+static void
+test_redirect(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+	guint before = httpstub_hits(env->stub, "/ok/5001");
+
+	AMZTEST_CHECK(env, fetch(env, session, "/redirect/5001", "redirect"));
+	AMZTEST_CHECK(env, matches(env, "redirect", 5001));
+	AMZTEST_CHECK(env, httpstub_hits(env->stub, "/ok/5001") == before + 1);
+
+	amzdownload_session_free(session);
+}
+
+static void
+test_chunked(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+
+	AMZTEST_CHECK(env, fetch(env, session, "/chunked/70000", "chunked"));
+	AMZTEST_CHECK(env, matches(env, "chunked", 70000));
+
+	amzdownload_session_free(session);
+}
+
+/* nothing arrives for a while; the transport must keep waiting on its timers. */
+static void
+test_stall(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+	GTimer *timer = g_timer_new();
+
+	AMZTEST_CHECK(env, fetch(env, session, "/stall/400/2000", "stall"));
+	AMZTEST_CHECK(env, g_timer_elapsed(timer, NULL) >= 0.4);
+	AMZTEST_CHECK(env, matches(env, "stall", 2000));
+
+	g_timer_destroy(timer);
+	amzdownload_session_free(session);
+}
+
+static void
+test_slow(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+
+	AMZTEST_CHECK(env, fetch(env, session, "/slow/20/20000", "slow"));
+	AMZTEST_CHECK(env, matches(env, "slow", 20000));
+
+	amzdownload_session_free(session);
+}
+
+static void
+test_reset(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+
+	AMZTEST_CHECK(env, !fetch(env, session, "/reset/200000", "reset"));
+	AMZTEST_CHECK(env, !exists(env, "reset"));
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+
+	amzdownload_session_free(session);
+}
+
+static void
+test_refused(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof addr;
+	gchar *url, *path;
+	gint fd;
+
+	/* a port that was just free is very unlikely to be taken again. */
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	AMZTEST_CHECK(env, bind(fd, (struct sockaddr *) &addr, sizeof addr) == 0);
+	AMZTEST_CHECK(env, getsockname(fd, (struct sockaddr *) &addr, &addrlen) == 0);
+	close(fd);
+
+	url = g_strdup_printf("http://127.0.0.1:%u/ok/10", ntohs(addr.sin_port));
+	path = amztest_path(env, "refused");
+
+	AMZTEST_CHECK(env, !amzdownload_session_download_url(session, url, path, NULL));
+	AMZTEST_CHECK(env, !exists(env, "refused"));
+
+	g_free(path);
+	g_free(url);
+	amzdownload_session_free(session);
+}
+
+static void
+count_finished(AMZDownloadContext *ctx)
+{
+	gint *counts = ctx->userdata;
+
+	counts[ctx->success ? 0 : 1]++;
+}
+
+/* eight stalled requests at once must overlap, not queue behind each other. */
+static void
+test_concurrent(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+	GTimer *timer;
+	gint counts[2] = { 0, 0 };
+	gchar *url, *path, *name;
+	guint i;
+
+	amzdownload_session_set_max_transfers(session, 8);
+
+	for (i = 0; i < 8; i++)
+	{
+		url = httpstub_url(env->stub, "/stall/500/1000");
+		name = g_strdup_printf("concurrent%u", i);
+		path = amztest_path(env, name);
+		amzdownload_session_queue_url(session, url, path, NULL, count_finished, counts);
+		g_free(path);
+		g_free(name);
+		g_free(url);
+	}
+
+	timer = g_timer_new();
+	amzdownload_session_run(session);
+
+	AMZTEST_CHECK(env, counts[0] == 8);
+	AMZTEST_CHECK(env, g_timer_elapsed(timer, NULL) < 1.5);
+	AMZTEST_CHECK(env, matches(env, "concurrent7", 1000));
+
+	g_timer_destroy(timer);
+	amzdownload_session_free(session);
+}
+
+/* freeing the session cancels a transfer that is still receiving. */
+static void
+test_cancel_free(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+	AMZDownloadContext *ctx;
+	gint counts[2] = { 0, 0 };
+	gchar *url, *path;
+
+	url = httpstub_url(env->stub, "/slow/50/1000000");
+	path = amztest_path(env, "cancel");
+	ctx = amzdownload_session_queue_url(session, url, path, NULL, count_finished, counts);
+
+	while (ctx->bytes == 0)
+		amzdownload_session_iterate(session, 100);
+
+	amzdownload_session_free(session);
+
+	AMZTEST_CHECK(env, counts[0] == 0 && counts[1] == 1);
+	AMZTEST_CHECK(env, !exists(env, "cancel"));
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+
+	g_free(path);
+	g_free(url);
+}
+
+/* running and queued transfers alike are reported as failed. */
+static void
+test_cancel_all(AMZTestEnv *env)
+{
+	AMZDownloadSession *session = amzdownload_session_new_with_transport(env->transport);
+	AMZDownloadContext *first = NULL;
+	gint counts[2] = { 0, 0 };
+	gchar *url, *path, *name;
+	guint i;
+
+	amzdownload_session_set_max_transfers(session, 2);
+
+	for (i = 0; i < 4; i++)
+	{
+		url = httpstub_url(env->stub, "/slow/50/1000000");
+		name = g_strdup_printf("cancel%u", i);
+		path = amztest_path(env, name);
+		first = amzdownload_session_queue_url(session, url, path, NULL, count_finished, counts);
+		g_free(path);
+		g_free(name);
+		g_free(url);
+
+		if (i == 0)
+		{
+			while (first->bytes == 0)
+				amzdownload_session_iterate(session, 100);
+		}
+	}
+
+	amzdownload_session_cancel_all(session);
+	amzdownload_session_run(session);
+
+	AMZTEST_CHECK(env, counts[0] == 0 && counts[1] == 4);
+	AMZTEST_CHECK(env, amztest_count_partials(env) == 0);
+
+	amzdownload_session_free(session);
+}
+
+/*
+ * Backends must accept a cancel from inside their own callbacks and report
+ * it from the next iteration; curl parks such requests until then.
+ */
+typedef struct {
+	const AMZTransportOps *ops;
+	AMZTransport *transport;
+	gsize bytes;
+	guint chunks_after_cancel;
+	guint finished;
+	guint status;
+	bool cancelled;
+} ParkedCancel;
+
+static void
+parked_got_headers(AMZTransportRequest *req, guint status, goffset length, gpointer userdata)
+{
+}
+
+static void
+parked_got_chunk(AMZTransportRequest *req, const gchar *data, gsize len, gpointer userdata)
+{
+	ParkedCancel *pc = userdata;
+
+	if (pc->cancelled)
+	{
+		pc->chunks_after_cancel++;
+		return;
+	}
+
+	pc->bytes += len;
+	pc->cancelled = true;
+	pc->ops->cancel(pc->transport, req);
+}
+
+static void
+parked_finished(AMZTransportRequest *req, guint status, const gchar *reason, gpointer userdata)
+{
+	ParkedCancel *pc = userdata;
+
+	pc->finished++;
+	pc->status = status;
+}
+
+static const AMZTransportCallbacks parked_callbacks = {
+	parked_got_headers,
+	parked_got_chunk,
+	parked_finished,
+};
+
+static void
+test_parked_cancel(AMZTestEnv *env)
+{
+	ParkedCancel pc;
+	GTimer *timer = g_timer_new();
+	gchar *url;
+	guint i;
+
+	memset(&pc, 0, sizeof pc);
+	for (i = 0; transports[i] != NULL; i++)
+	{
+		if (!strcmp(transports[i]->name, env->transport))
+			pc.ops = transports[i];
+	}
+
+	AMZTEST_CHECK(env, pc.ops != NULL);
+	AMZTEST_CHECK(env, (pc.transport = pc.ops->create()) != NULL);
+
+	url = httpstub_url(env->stub, "/slow/20/100000");
+	pc.ops->start(pc.transport, url, &parked_callbacks, &pc);
+
+	while (pc.finished == 0 && g_timer_elapsed(timer, NULL) < 10)
+		pc.ops->iterate(pc.transport, 100);
+
+	/* give a late report a chance to show up. */
+	for (i = 0; i < 5; i++)
+		pc.ops->iterate(pc.transport, 20);
+
+	pc.ops->destroy(pc.transport);
+	g_timer_destroy(timer);
+	g_free(url);
+
+	AMZTEST_CHECK(env, pc.bytes > 0);
+	AMZTEST_CHECK(env, pc.finished == 1);
+	AMZTEST_CHECK(env, pc.status == AMZ_TRANSPORT_STATUS_CANCELLED);
+	AMZTEST_CHECK(env, pc.chunks_after_cancel == 0);
+}
+
+static const struct {
+	const gchar *name;
+	AMZTestFunc func;
+} tests[] = {
+	{ "ok", test_ok },
+	{ "empty", test_empty },
+	{ "not-found", test_not_found },
+	{ "redirect", test_redirect },
+	{ "chunked", test_chunked },
+	{ "stall", test_stall },
+	{ "slow", test_slow },
+	{ "reset", test_reset },
+	{ "refused", test_refused },
+	{ "concurrent", test_concurrent },
+	{ "cancel-free", test_cancel_free },
+	{ "cancel-all", test_cancel_all },
+	{ "parked-cancel", test_parked_cancel },
+};
+
+/*
+ * Runs every case through each transport that was built; one that cannot
+ * be created here is reported as skipped.
+ */
+void
+transport_tests(AMZTestEnv *env)
+{
+	AMZDownloadSession *session;
+	gchar *name;
+	guint i, j;
+
+	for (i = 0; transports[i] != NULL; i++)
+	{
+		env->transport = transports[i]->name;
+
+		if ((session = amzdownload_session_new_with_transport(env->transport)) == NULL)
+		{
+			printf("SKIP transport/%s: not available\n", env->transport);
+			continue;
+		}
+
+		amzdownload_session_free(session);
+
+		for (j = 0; j < G_N_ELEMENTS(tests); j++)
+		{
+			name = g_strdup_printf("transport/%s/%s", env->transport, tests[j].name);
+			amztest_run(env, name, tests[j].func);
+			g_free(name);
+		}
+	}
+
+	env->transport = NULL;
+}